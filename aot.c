@@ -0,0 +1,373 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "chip8.h"
+#include "disasm.h"
+#include "predecode.h"
+#include "romcache.h"
+
+#define DEFAULT_SYMBOL "chip8_aot_program"
+//Native code tracks writes in 64 byte pages, as chip8_memory_written does
+#define PAGE_SHIFT 6
+//Longest block, one pass through all of memory
+#define MAX_BLOCK (CHIP8_MEMORY_SIZE / 2)
+
+//Control flow of a ROM as loaded at power on
+struct aot_program {
+    const uint8_t* memory;
+    bool reachable[CHIP8_MEMORY_SIZE];
+    //Set for block starts, every one gets a label in the generated code
+    bool leader[CHIP8_MEMORY_SIZE];
+};
+
+static uint16_t instruction_at(const struct aot_program* program, uint16_t address) {
+    return program->memory[address] << 8 | program->memory[(address + 1) & CHIP8_ADDRESS_MASK];
+}
+
+static uint16_t next_address(uint16_t address, int instructions) {
+    return (address + 2 * instructions) & CHIP8_ADDRESS_MASK;
+}
+
+/*
+    Instructions that leave a block. Besides branches this is everything that writes memory,
+    so the next block checks the dirty pages again, and everything that can wait on itself.
+*/
+static bool ends_block(uint8_t op) {
+    return op == OP_JP || op == OP_CALL || op == OP_RET || op == OP_JP_V0 || op == OP_SE_IMM ||
+        op == OP_SNE_IMM || op == OP_SE_REG || op == OP_SNE_REG || op == OP_SKP || op == OP_SKNP ||
+        op == OP_DRW || op == OP_LD_KEY || op == OP_BCD || op == OP_STORE;
+}
+
+/*
+    Marks every instruction reachable from 0x200, and the block leaders among them.
+    Returns and Bnnn are only known at run time, their targets run on the interpreter unless
+    some other path makes them leaders.
+*/
+static bool trace(struct aot_program* program) {
+    uint16_t* pending = malloc(sizeof(uint16_t) * CHIP8_MEMORY_SIZE * 2);
+    int count = 0;
+
+    if(!pending) {
+        return false;
+    }
+
+    program->leader[CHIP8_ROM_ADDRESS] = true;
+    pending[count++] = CHIP8_ROM_ADDRESS;
+
+    while(count) {
+        uint16_t pc = pending[--count];
+        uint16_t next[2];
+        int num_next = 0;
+        struct chip8_decoded d;
+
+        if(program->reachable[pc]) {
+            continue;
+        }
+        program->reachable[pc] = true;
+        chip8_decode(instruction_at(program, pc), &d);
+
+        switch(d.op) {
+            case OP_JP:
+                next[num_next++] = d.nnn;
+                break;
+            case OP_CALL:
+                next[num_next++] = d.nnn;
+                next[num_next++] = next_address(pc, 1);
+                break;
+            case OP_SE_IMM: case OP_SNE_IMM: case OP_SE_REG: case OP_SNE_REG: case OP_SKP: case OP_SKNP:
+                next[num_next++] = next_address(pc, 1);
+                next[num_next++] = next_address(pc, 2);
+                break;
+            case OP_RET: case OP_JP_V0:
+                break;
+            default:
+                next[num_next++] = next_address(pc, 1);
+                break;
+        }
+
+        int i = 0;
+        for(;i < num_next;i++) {
+            if(ends_block(d.op)) {
+                program->leader[next[i]] = true;
+            }
+            if(!program->reachable[next[i]] && count < CHIP8_MEMORY_SIZE * 2) {
+                pending[count++] = next[i];
+            }
+        }
+    }
+
+    free(pending);
+    return true;
+}
+
+//Continues at a known address, straight into its block when it has one
+static void emit_goto(FILE* out, const struct aot_program* program, uint16_t target, const char* indent) {
+    if(program->leader[target]) {
+        fprintf(out, "%svm->pc = 0x%03X;\n%sgoto block_%03X;\n", indent, target, indent, target);
+    }
+    else {
+        fprintf(out, "%svm->pc = 0x%03X;\n%scontinue;\n", indent, target, indent);
+    }
+}
+
+/*
+    Writes the C of one instruction inside a block, the same semantics as execute_instruction
+    @param pc Address of the instruction
+*/
+static void emit_instruction(FILE* out, const struct aot_program* program, uint16_t pc) {
+    uint16_t instruction = instruction_at(program, pc);
+    uint16_t next = next_address(pc, 1);
+    uint16_t skip = next_address(pc, 2);
+    struct chip8_decoded d;
+    char text[32];
+    const char* condition = NULL;
+    char compare[64];
+
+    chip8_decode(instruction, &d);
+    chip8_disassemble(instruction, text, sizeof(text));
+    fprintf(out, "        //0x%03X  %04X  %s\n", pc, instruction, text);
+
+    switch(d.op) {
+        case OP_CLS: fprintf(out, "        chip8_clear_screen(vm);\n"); return;
+        case OP_LD_IMM: fprintf(out, "        V[0x%X] = 0x%02X;\n", d.x, d.kk); return;
+        case OP_ADD_IMM: fprintf(out, "        V[0x%X] += 0x%02X;\n", d.x, d.kk); return;
+        case OP_LD_REG: fprintf(out, "        V[0x%X] = V[0x%X];\n", d.x, d.y); return;
+        case OP_OR: fprintf(out, "        V[0x%X] |= V[0x%X];\n        V[0xF] = 0;\n", d.x, d.y); return;
+        case OP_AND: fprintf(out, "        V[0x%X] &= V[0x%X];\n        V[0xF] = 0;\n", d.x, d.y); return;
+        case OP_XOR: fprintf(out, "        V[0x%X] ^= V[0x%X];\n        V[0xF] = 0;\n", d.x, d.y); return;
+        //The flag is written last, so it wins when x is F
+        case OP_ADD_REG:
+            fprintf(out, "        { int t = V[0x%X] + V[0x%X]; V[0x%X] = t; V[0xF] = t >> 8; }\n", d.x, d.y, d.x);
+            return;
+        case OP_SUB:
+            fprintf(out, "        { int t = V[0x%X] - V[0x%X]; V[0x%X] = t; V[0xF] = t >= 0; }\n", d.x, d.y, d.x);
+            return;
+        case OP_SUBN:
+            fprintf(out, "        { int t = V[0x%X] - V[0x%X]; V[0x%X] = t; V[0xF] = t >= 0; }\n", d.y, d.x, d.x);
+            return;
+        case OP_SHR:
+            fprintf(out, "        { int t = V[0x%X] & 1; V[0x%X] = V[0x%X] >> 1; V[0xF] = t; }\n", d.y, d.x, d.y);
+            return;
+        case OP_SHL:
+            fprintf(out, "        { int t = V[0x%X] >> 7; V[0x%X] = V[0x%X] << 1; V[0xF] = t; }\n", d.y, d.x, d.y);
+            return;
+        case OP_LD_I: fprintf(out, "        vm->index_register = 0x%03X;\n", d.nnn); return;
+        case OP_RND: fprintf(out, "        V[0x%X] = chip8_random(vm) & 0x%02X;\n", d.x, d.kk); return;
+        case OP_LD_VX_DT: fprintf(out, "        V[0x%X] = vm->delay_timer;\n", d.x); return;
+        case OP_LD_DT: fprintf(out, "        vm->delay_timer = V[0x%X];\n", d.x); return;
+        case OP_LD_ST: fprintf(out, "        vm->sound_timer = V[0x%X];\n", d.x); return;
+        case OP_ADD_I:
+            fprintf(out, "        vm->index_register += V[0x%X];\n        V[0xF] = vm->index_register > 0xFFF;\n", d.x);
+            return;
+        case OP_LD_FONT: fprintf(out, "        vm->index_register = V[0x%X] * 5;\n", d.x); return;
+        case OP_LOAD: fprintf(out, "        chip8_load_registers(vm, 0x%X);\n", d.x); return;
+
+        //Block ends
+        case OP_JP:
+            emit_goto(out, program, d.nnn, "        ");
+            return;
+        case OP_CALL:
+            fprintf(out, "        vm->stack[vm->stack_ptr++ & 0xF] = 0x%03X;\n", next);
+            emit_goto(out, program, d.nnn, "        ");
+            return;
+        case OP_RET:
+            fprintf(out, "        vm->pc = vm->stack[--vm->stack_ptr & 0xF];\n        continue;\n");
+            return;
+        case OP_JP_V0:
+            fprintf(out, "        vm->pc = (V[0x0] + 0x%03X) & 0xFFF;\n        continue;\n", d.nnn);
+            return;
+        case OP_SE_IMM: case OP_SNE_IMM:
+            snprintf(compare, sizeof(compare), "V[0x%X] %s 0x%02X", d.x, d.op == OP_SE_IMM ? "==" : "!=", d.kk);
+            condition = compare;
+            break;
+        case OP_SE_REG: case OP_SNE_REG:
+            snprintf(compare, sizeof(compare), "V[0x%X] %s V[0x%X]", d.x, d.op == OP_SE_REG ? "==" : "!=", d.y);
+            condition = compare;
+            break;
+        case OP_SKP: case OP_SKNP:
+            snprintf(compare, sizeof(compare), "%schip8_key_down(vm, V[0x%X])", d.op == OP_SKP ? "" : "!", d.x);
+            condition = compare;
+            break;
+        //Sprites held back by the display wait and Fx0A run again from their own address
+        case OP_DRW:
+            fprintf(out, "        if(!chip8_draw_sprite(vm, 0x%X, 0x%X, %d)) {\n            vm->pc = 0x%03X;\n            continue;\n        }\n",
+                d.x, d.y, d.n, pc);
+            emit_goto(out, program, next, "        ");
+            return;
+        case OP_LD_KEY:
+            fprintf(out, "        if(!chip8_key_pressed(vm, &V[0x%X])) {\n            vm->pc = 0x%03X;\n            continue;\n        }\n",
+                d.x, pc);
+            emit_goto(out, program, next, "        ");
+            return;
+        case OP_BCD:
+            fprintf(out, "        chip8_store_bcd(vm, 0x%X);\n", d.x);
+            emit_goto(out, program, next, "        ");
+            return;
+        case OP_STORE:
+            fprintf(out, "        chip8_store_registers(vm, 0x%X);\n", d.x);
+            emit_goto(out, program, next, "        ");
+            return;
+        default:
+            return;
+    }
+
+    fprintf(out, "        if(%s) {\n", condition);
+    emit_goto(out, program, skip, "            ");
+    fprintf(out, "        }\n");
+    emit_goto(out, program, next, "        ");
+}
+
+/*
+    Writes the instructions of a block and the jump out of it
+    @param counted Stop when the budget runs out before each instruction
+*/
+static void emit_body(FILE* out, const struct aot_program* program, uint16_t start, int length, bool counted) {
+    struct chip8_decoded d;
+    uint16_t pc = start;
+    int i = 0;
+
+    for(;i < length;i++) {
+        if(counted) {
+            fprintf(out, "        if(!left) {\n            vm->pc = 0x%03X;\n            return;\n        }\n        left--;\n", pc);
+        }
+        emit_instruction(out, program, pc);
+        chip8_decode(instruction_at(program, pc), &d);
+        pc = next_address(pc, 1);
+    }
+
+    if(!ends_block(d.op)) {
+        emit_goto(out, program, pc, "        ");
+    }
+}
+
+/*
+    Writes one block: the dirty page check, the budget check and its instructions
+*/
+static void emit_block(FILE* out, const struct aot_program* program, uint16_t start) {
+    uint64_t pages = 0;
+    uint16_t pc = start;
+    int length = 0;
+    struct chip8_decoded d;
+
+    //A block runs until it branches or falls into another block
+    do {
+        pages |= 1ULL << (pc >> PAGE_SHIFT);
+        pages |= 1ULL << (((pc + 1) & CHIP8_ADDRESS_MASK) >> PAGE_SHIFT);
+        chip8_decode(instruction_at(program, pc), &d);
+        pc = next_address(pc, 1);
+        length++;
+    } while(!ends_block(d.op) && !program->leader[pc] && length < MAX_BLOCK);
+
+    fprintf(out, "\n    block_%03X:\n", start);
+    fprintf(out, "        if(vm->native_dirty & 0x%016llXULL) {\n            vm->pc = 0x%03X;\n            goto fallback;\n        }\n",
+        (unsigned long long) pages, start);
+    fprintf(out, "        if(left < %d) {\n            goto counted_%03X;\n        }\n        left -= %d;\n", length, start, length);
+    emit_body(out, program, start, length, false);
+
+    //Same block for the end of the budget, counting one instruction at a time
+    fprintf(out, "\n    counted_%03X:\n", start);
+    emit_body(out, program, start, length, true);
+}
+
+/*
+    Writes the C translation of a ROM
+    @returns False if the file couldn't be written
+*/
+static bool emit(const struct aot_program* program, const struct chip8_rom* rom, const char* rom_path, const char* filepath, const char* symbol) {
+    FILE* out = fopen(filepath, "w");
+    int blocks = 0;
+    int i = 0;
+
+    if(!out) {
+        return false;
+    }
+
+    fprintf(out, "//Generated by chip8_aot from %s, do not edit\n#include \"chip8.h\"\n\n", rom_path);
+    fprintf(out,
+        "static void step(struct chip8_vm* vm) {\n"
+        "    uint16_t pc = vm->pc;\n"
+        "    uint16_t instruction = chip8_instruction_at(vm, pc);\n\n"
+        "    vm->pc = (pc + 2) & CHIP8_ADDRESS_MASK;\n"
+        "    execute_instruction(vm, instruction);\n"
+        "}\n\n");
+
+    fprintf(out,
+        "/*\n"
+        "    Runs count instructions. Each block checks that enough of the budget is left for all of it and\n"
+        "    that none of its pages were written since the ROM was loaded, otherwise the interpreter runs\n"
+        "    one instruction. Addresses only known at run time are dispatched through the switch.\n"
+        "*/\n"
+        "static void run(struct chip8_vm* vm, uint64_t count) {\n"
+        "    uint8_t* const V = vm->registers;\n"
+        "    uint64_t left = count;\n\n"
+        "    vm->cycles += count;\n"
+        "    while(left) {\n"
+        "        switch(vm->pc) {\n");
+
+    for(;i < CHIP8_MEMORY_SIZE;i++) {
+        if(program->leader[i] && program->reachable[i]) {
+            fprintf(out, "            case 0x%03X: goto block_%03X;\n", i, i);
+        }
+    }
+
+    fprintf(out,
+        "        }\n\n"
+        "    fallback:\n"
+        "        if(!left) {\n"
+        "            break;\n"
+        "        }\n"
+        "        step(vm);\n"
+        "        left--;\n"
+        "        continue;\n");
+
+    for(i = 0;i < CHIP8_MEMORY_SIZE;i++) {
+        if(program->leader[i] && program->reachable[i]) {
+            emit_block(out, program, i);
+            blocks++;
+        }
+    }
+
+    fprintf(out, "    }\n}\n\n");
+    fprintf(out, "//%d blocks\nconst struct chip8_native %s = {0x%016llXULL, %zu, run};\n",
+        blocks, symbol, (unsigned long long) rom->hash, rom->size);
+
+    return !fclose(out);
+}
+
+/*
+    Usage: chip8_aot rom output.c [symbol]
+    Translates the code reachable from 0x200 into C. Build the output into a program with -DCHIP8_AOT
+    and main.c runs it whenever that ROM is loaded.
+    symbol  Name of the struct chip8_native, defaults to chip8_aot_program
+*/
+int main(int argc, char* argv[]) {
+    struct aot_program* program = calloc(1, sizeof(*program));
+    const struct chip8_rom* rom;
+
+    if(argc < 3 || !program) {
+        printf("Usage: chip8_aot rom output.c [symbol]\n");
+        free(program);
+        return -1;
+    }
+
+    if(!(rom = rom_cache_load(argv[1]))) {
+        printf("Couldn't open file %s\n", argv[1]);
+        free(program);
+        return -1;
+    }
+
+    program->memory = rom->image;
+    if(!trace(program) || !emit(program, rom, argv[1], argv[2], argc > 3 ? argv[3] : DEFAULT_SYMBOL)) {
+        printf("Couldn't write %s\n", argv[2]);
+        free(program);
+        return -1;
+    }
+
+    free(program);
+    return 0;
+}
+
+#undef DEFAULT_SYMBOL
+#undef PAGE_SHIFT
+#undef MAX_BLOCK
@@ -0,0 +1,29 @@
+#ifndef BACKEND_H
+#define BACKEND_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+struct chip8_vm;
+
+/*
+    Display, input and audio device used by the Chip8 core.
+    run_chip is given one of these at startup and only talks to the device through it.
+    The framebuffer and keyboard live in the chip8_vm, backends present and update them.
+*/
+struct backend {
+    const char* name;
+    //True if the backend is tied to a real time device and execution must be paced
+    bool realtime;
+
+    bool (*initialize)(struct chip8_vm* vm);
+    void (*close)(struct chip8_vm* vm);
+    //Presents vm->display once per frame. Only rows set in vm->dirty_rows changed, the backend clears it
+    void (*draw)(struct chip8_vm* vm);
+    //Called once per frame. Updates vm->keypad and vm->key_up. Returns false once the backend wants the emulator to stop
+    bool (*handle_events)(struct chip8_vm* vm);
+    //Called once per frame with whether the sound timer is running. Must not block.
+    void (*set_sound)(struct chip8_vm* vm, bool on);
+};
+
+#endif
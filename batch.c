@@ -0,0 +1,182 @@
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "batch.h"
+#include "capture.h"
+#include "chip8.h"
+#include "headless.h"
+#include "lockstep.h"
+
+#define DEBUG 0
+#define FNV_OFFSET 0xCBF29CE484222325ULL
+#define FNV_PRIME 0x100000001B3ULL
+
+//Jobs shared by every worker, each worker claims the next unclaimed index
+struct batch_queue {
+    struct batch_job* jobs;
+    int count;
+    const struct chip8_config* config;
+    atomic_int next;
+};
+
+/*
+    Hashes the framebuffer so runs can be compared without keeping the pixels
+*/
+static uint64_t display_hash(struct chip8_vm* vm) {
+    uint64_t hash = FNV_OFFSET;
+    const uint8_t* it = (const uint8_t*) vm->display;
+    size_t i = 0;
+
+    for(;i < sizeof(vm->display);i++) {
+        hash = (hash ^ it[i]) * FNV_PRIME;
+    }
+
+    return hash;
+}
+
+/*
+    Runs one job on its own machine until the headless backend stops it
+*/
+static void run_job(struct chip8_vm* vm, struct batch_job* job, const struct chip8_config* config) {
+    chip8_init(vm, &headless_backend);
+    chip8_configure(vm, config);
+
+    if(!chip8_load(vm, job->rom) || (job->resume && !chip8_restore_state(vm, job->resume)) || !vm->io->initialize(vm)) {
+        if(DEBUG) {
+            printf("Couldn't start %s\n", job->rom);
+        }
+        chip8_release(vm);
+        job->ok = false;
+        return;
+    }
+
+    if(job->capture && !(vm->capture = capture_start(job->capture, capture_format_from_path(job->capture)))) {
+        if(DEBUG) {
+            printf("Couldn't capture to %s\n", job->capture);
+        }
+    }
+
+    chip8_run(vm);
+
+    if(vm->capture) {
+        capture_stop(vm->capture);
+        vm->capture = NULL;
+    }
+
+    job->ok = true;
+    job->cycles = vm->cycles;
+    job->frames = vm->frames;
+    job->display_hash = display_hash(vm);
+    if(job->checkpoint) {
+        chip8_save_state(vm, job->checkpoint);
+    }
+
+    vm->io->close(vm);
+    chip8_release(vm);
+}
+
+/*
+    Worker thread, claims jobs until none are left
+*/
+static void* worker(void* arg) {
+    struct batch_queue* queue = arg;
+    struct chip8_vm* vm = malloc(sizeof(*vm));
+    int i;
+
+    if(!vm) {
+        return NULL;
+    }
+
+    while((i = atomic_fetch_add(&queue->next, 1)) < queue->count) {
+        run_job(vm, &queue->jobs[i], queue->config);
+    }
+
+    free(vm);
+    return NULL;
+}
+
+/*
+    Runs independent headless machines on a pool of worker threads
+    @param jobs ROMs to run, results are written back into each job
+    @param count Number of jobs
+    @param threads Number of worker threads
+    @param config Execution tier and pacing of every machine
+    @returns False if no worker could be started
+*/
+bool run_batch(struct batch_job* jobs, int count, int threads, const struct chip8_config* config) {
+    struct batch_queue queue = {jobs, count, config, 0};
+    pthread_t* pool;
+    int started = 0;
+
+    if(threads < 1) {
+        threads = 1;
+    }
+    if(threads > count) {
+        threads = count;
+    }
+
+    if(!(pool = malloc(sizeof(pthread_t) * threads))) {
+        return false;
+    }
+
+    atomic_init(&queue.next, 0);
+
+    for(;started < threads;started++) {
+        if(pthread_create(&pool[started], NULL, worker, &queue)) {
+            break;
+        }
+    }
+
+    //Jobs left by threads that failed to start are run by the ones that did
+    int i = 0;
+    for(;i < started;i++) {
+        pthread_join(pool[i], NULL);
+    }
+
+    free(pool);
+    return started > 0;
+}
+
+/*
+    Runs jobs that all load the same ROM as the lanes of one lockstep group on the calling thread.
+    Captures are not supported. With a fixed seed lane i gets seed + i.
+    @returns False if the machines could not be created
+*/
+bool run_lockstep(struct batch_job* jobs, int count, const struct chip8_config* config) {
+    struct chip8_lockstep* ls = lockstep_create(count, config);
+    bool loaded;
+    int i = 0;
+
+    if(!ls) {
+        return false;
+    }
+
+    loaded = lockstep_load(ls, jobs[0].rom);
+    for(;i < count;i++) {
+        jobs[i].ok = loaded && (!jobs[i].resume || chip8_restore_state(lockstep_lane(ls, i), jobs[i].resume));
+    }
+
+    if(loaded) {
+        lockstep_run(ls);
+    }
+
+    for(i = 0;i < count;i++) {
+        struct chip8_vm* vm = lockstep_lane(ls, i);
+
+        jobs[i].cycles = vm->cycles;
+        jobs[i].frames = vm->frames;
+        jobs[i].display_hash = display_hash(vm);
+        if(jobs[i].checkpoint) {
+            chip8_save_state(vm, jobs[i].checkpoint);
+        }
+    }
+
+    lockstep_destroy(ls);
+    return true;
+}
+
+#undef DEBUG
+#undef FNV_OFFSET
+#undef FNV_PRIME
@@ -0,0 +1,30 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "chip8.h"
+#include "savestate.h"
+
+//One headless machine run by run_batch
+struct batch_job {
+    const char* rom;
+    //Continue from this state instead of the start of the ROM, may be NULL
+    const struct chip8_savestate* resume;
+    //Receives the final state if not NULL
+    struct chip8_savestate* checkpoint;
+    //Records every frame to this file, format from the name as in capture_format_from_path, may be NULL
+    const char* capture;
+
+    //Filled in by run_batch
+    bool ok;
+    uint64_t cycles;
+    uint64_t frames;
+    //FNV-1a hash of the final framebuffer
+    uint64_t display_hash;
+};
+
+bool run_batch(struct batch_job* jobs, int count, int threads, const struct chip8_config* config);
+bool run_lockstep(struct batch_job* jobs, int count, const struct chip8_config* config);
+
+#endif
@@ -0,0 +1,161 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "chip8.h"
+#include "headless.h"
+
+#define DEFAULT_INSTRUCTIONS 20000000ULL
+#define NS_PER_SEC 1000000000.0
+#define MAX_ROM_WORDS 32
+
+//Generated ROM that loops forever on one class of opcodes
+struct bench_rom {
+    const char* name;
+    //Opcode class the loop is made of
+    const char* opcodes;
+    uint16_t words[MAX_ROM_WORDS];
+    int num_words;
+};
+
+static const struct bench_rom roms[] = {
+    //8xyN and 7xkk in a loop with one skip
+    {"alu", "6xkk,7xkk,8xyN,3xkk,1nnn", {
+        0x6001, 0x6103, 0x6207, 0x6300,
+        0x8014, 0x8125, 0x8236, 0x830E, 0x8401, 0x7301, 0x8532, 0x3500, 0x6501, 0x1208
+    }, 14},
+    //8 and 15 row sprites moving across the screen
+    {"sprite", "Dxyn", {
+        0x6000, 0x6100, 0xA220,
+        0xD018, 0x7003, 0x7105, 0xD01F, 0x7007, 0x1206, 0x0000,
+        0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000,
+        //0x220: sprite data
+        0xFF81, 0xBDA5, 0xA5BD, 0x81FF, 0x3C42, 0x8181, 0x423C, 0x1800
+    }, 24},
+    //Store and load 8 registers through data memory
+    {"memory", "Fx55,Fx65,Annn", {
+        0x6001, 0x6102, 0x6203, 0x6304,
+        0xA300, 0xF755, 0xA300, 0xF765, 0x7001, 0x1208
+    }, 10},
+    //Two levels of subroutine calls
+    {"call", "2nnn,00EE", {
+        0x2206, 0x1200, 0x0000,
+        0x220C, 0x7001, 0x00EE,
+        0x7101, 0x00EE
+    }, 8}
+};
+
+static const char* const tier_names[] = {"interpreter", "predecode", "jit"};
+
+static double now(void) {
+    struct timespec t;
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / NS_PER_SEC;
+}
+
+/*
+    Runs one ROM headless and unthrottled until it executed at least instructions
+    and prints one JSON line with the result
+    @returns False if the machine could not be started
+*/
+static bool bench(struct chip8_vm* vm, const struct bench_rom* rom, const struct chip8_config* config, uint64_t instructions) {
+    uint8_t image[MAX_ROM_WORDS * 2];
+    int i = 0;
+
+    for(;i < rom->num_words;i++) {
+        image[2 * i] = rom->words[i] >> 8;
+        image[2 * i + 1] = rom->words[i] & 0xFF;
+    }
+
+    chip8_init(vm, &headless_backend);
+    chip8_configure(vm, config);
+
+    if(!chip8_load_rom(vm, image, rom->num_words * 2) || !vm->io->initialize(vm)) {
+        chip8_release(vm);
+        return false;
+    }
+
+    double start = now();
+    while(vm->cycles < instructions) {
+        chip8_run_frame(vm);
+    }
+    double seconds = now() - start;
+
+    printf("{\"rom\":\"%s\",\"opcodes\":\"%s\",\"tier\":\"%s\",\"instructions\":%llu,\"frames\":%llu,"
+        "\"seconds\":%.6f,\"instructions_per_sec\":%.0f,\"ns_per_opcode\":%.3f,\"frames_per_sec\":%.0f}\n",
+        rom->name, rom->opcodes, tier_names[vm->tier], (unsigned long long) vm->cycles, (unsigned long long) vm->frames,
+        seconds, vm->cycles / seconds, seconds * NS_PER_SEC / vm->cycles, vm->frames / seconds);
+
+    vm->io->close(vm);
+    chip8_release(vm);
+    return true;
+}
+
+/*
+    Usage: chip8_bench [-n instructions] [-cpf n] [-tier name] [-rom name]
+    Prints one JSON object per line for every ROM and tier
+    -n      Instructions to run per ROM, defaults to 20000000
+    -cpf    Instructions per frame, defaults to 700 Hz
+    -tier   Only run interpreter, predecode or jit
+    -rom    Only run alu, sprite, memory or call
+*/
+int main(int argc, char* argv[]) {
+    uint64_t instructions = DEFAULT_INSTRUCTIONS;
+    const char* only_tier = NULL;
+    const char* only_rom = NULL;
+    struct chip8_config config;
+    struct chip8_vm* vm = malloc(sizeof(*vm));
+
+    chip8_default_config(&config);
+    config.unthrottled = true;
+
+    int i = 1;
+    for(;i < argc;i++) {
+        if(!strcmp(argv[i], "-n") && i + 1 < argc) {
+            instructions = strtoull(argv[++i], NULL, 10);
+        }
+        else if(!strcmp(argv[i], "-cpf") && i + 1 < argc) {
+            config.cycles_per_frame = atoi(argv[++i]);
+        }
+        else if(!strcmp(argv[i], "-tier") && i + 1 < argc) {
+            only_tier = argv[++i];
+        }
+        else if(!strcmp(argv[i], "-rom") && i + 1 < argc) {
+            only_rom = argv[++i];
+        }
+        else {
+            printf("Unknown option %s\n", argv[i]);
+            return -1;
+        }
+    }
+
+    size_t r = 0;
+    for(;r < sizeof(roms) / sizeof(roms[0]);r++) {
+        if(only_rom && strcmp(only_rom, roms[r].name)) {
+            continue;
+        }
+
+        int t = CHIP8_TIER_INTERPRETER;
+        for(;t <= CHIP8_TIER_JIT;t++) {
+            if(only_tier && strcmp(only_tier, tier_names[t])) {
+                continue;
+            }
+
+            config.tier = t;
+            if(!bench(vm, &roms[r], &config, instructions)) {
+                printf("Couldn't start %s\n", roms[r].name);
+                return -1;
+            }
+        }
+    }
+
+    free(vm);
+    return 0;
+}
+
+#undef DEFAULT_INSTRUCTIONS
+#undef NS_PER_SEC
+#undef MAX_ROM_WORDS
@@ -0,0 +1,472 @@
+#define _POSIX_C_SOURCE 200809L
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "capture.h"
+#include "chip8.h"
+
+#define DEBUG 0
+//Frames the encoder may fall behind before new ones are dropped
+#define POOL_SIZE 64
+#define MAX_PATH 4096
+#define FPS 60
+//Bytes of a 1 bit row, PNG and the display both put x = 0 in the top bit
+#define ROW_BYTES (CHIP8_WIDTH / 8)
+#define PNG_DATA (CHIP8_HEIGHT * (1 + ROW_BYTES))
+#define PNG_SIZE (8 + 25 + 12 + 2 + 5 + PNG_DATA + 4 + 12)
+//Shortest GIF frame delay in 1/100 s that viewers honour
+#define GIF_MIN_DELAY 2
+#define GIF_MIN_CODE_SIZE 2
+#define GIF_MAX_CODES 4096
+
+//Copy of the framebuffer taken at the end of a frame
+struct capture_slot {
+    uint64_t display[CHIP8_HEIGHT];
+    uint64_t frame;
+};
+
+/*
+    Frames are copied into a fixed pool by the emulation thread and encoded by a background thread.
+    Every buffer is allocated by capture_start, encoding a frame allocates nothing.
+*/
+struct chip8_capture {
+    enum capture_format format;
+    char path[MAX_PATH];
+    FILE* file;
+
+    struct capture_slot pool[POOL_SIZE];
+    //Frames queued and frames encoded, guarded by lock
+    uint64_t head;
+    uint64_t tail;
+    bool stopping;
+    uint64_t dropped;
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    pthread_cond_t space;
+    pthread_t thread;
+
+    //Encoder scratch
+    uint8_t gray[CHIP8_HEIGHT][CHIP8_WIDTH];
+    uint8_t png[PNG_SIZE];
+    char name[MAX_PATH + 16];
+    //GIF frame waiting for the next change, and where it started
+    uint64_t gif_pending[CHIP8_HEIGHT];
+    uint64_t gif_pending_frame;
+    uint64_t gif_last_frame;
+    bool gif_has_pending;
+    uint16_t gif_tree[GIF_MAX_CODES][2];
+    uint8_t gif_block[256];
+    int gif_block_len;
+    uint32_t gif_bits;
+    int gif_bit_count;
+};
+
+static uint32_t crc_table[256];
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+static void build_crc_table(void) {
+    uint32_t n = 0;
+
+    for(;n < 256;n++) {
+        uint32_t c = n;
+        int k = 0;
+        for(;k < 8;k++) {
+            c = c & 1 ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+        }
+        crc_table[n] = c;
+    }
+}
+
+static uint32_t crc32(const uint8_t* data, size_t length) {
+    uint32_t c = 0xFFFFFFFFu;
+    size_t i = 0;
+
+    for(;i < length;i++) {
+        c = crc_table[(c ^ data[i]) & 0xFF] ^ (c >> 8);
+    }
+
+    return c ^ 0xFFFFFFFFu;
+}
+
+static uint8_t* put32(uint8_t* out, uint32_t value) {
+    out[0] = value >> 24;
+    out[1] = value >> 16;
+    out[2] = value >> 8;
+    out[3] = value;
+    return out + 4;
+}
+
+/*
+    Chunk of length bytes already at out + 8, fills in the header and CRC
+    @returns End of the chunk
+*/
+static uint8_t* finish_chunk(uint8_t* out, const char* type, uint32_t length) {
+    put32(out, length);
+    memcpy(out + 4, type, 4);
+    return put32(out + 8 + length, crc32(out + 4, length + 4));
+}
+
+/*
+    Writes one frame as a 1 bit grayscale PNG. The image data is one stored deflate block,
+    which is smaller than the compression code and still only 350 bytes.
+*/
+static bool write_png(struct chip8_capture* capture, const struct capture_slot* slot) {
+    static const uint8_t signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n'};
+    uint8_t* out = capture->png;
+    uint8_t* data;
+    uint32_t a = 1;
+    uint32_t b = 0;
+    int y = 0;
+
+    memcpy(out, signature, 8);
+    out += 8;
+
+    //IHDR: size, 1 bit depth, grayscale, no interlace
+    data = put32(put32(out + 8, CHIP8_WIDTH), CHIP8_HEIGHT);
+    memcpy(data, "\x01\x00\x00\x00\x00", 5);
+    out = finish_chunk(out, "IHDR", 13);
+
+    //IDAT: zlib header, stored block header, rows with filter 0, Adler-32
+    data = out + 8;
+    *data++ = 0x78;
+    *data++ = 0x01;
+    *data++ = 0x01;
+    *data++ = PNG_DATA & 0xFF;
+    *data++ = PNG_DATA >> 8;
+    *data++ = ~PNG_DATA & 0xFF;
+    *data++ = (~PNG_DATA >> 8) & 0xFF;
+    for(;y < CHIP8_HEIGHT;y++) {
+        int i = 0;
+        *data++ = 0;
+        for(;i < ROW_BYTES;i++) {
+            *data++ = slot->display[y] >> (56 - i * 8);
+        }
+    }
+    for(y = 0;y < PNG_DATA;y++) {
+        a = (a + data[y - PNG_DATA]) % 65521;
+        b = (b + a) % 65521;
+    }
+    put32(data, b << 16 | a);
+    out = finish_chunk(out, "IDAT", 2 + 5 + PNG_DATA + 4);
+    out = finish_chunk(out, "IEND", 0);
+
+    snprintf(capture->name, sizeof(capture->name), "%s%06llu.png", capture->path, (unsigned long long) slot->frame);
+    int fd = open(capture->name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(fd < 0) {
+        return false;
+    }
+
+    bool ok = write(fd, capture->png, out - capture->png) == out - capture->png;
+    return !close(fd) && ok;
+}
+
+static bool write_raw(struct chip8_capture* capture, const struct capture_slot* slot) {
+    int y = 0;
+
+    for(;y < CHIP8_HEIGHT;y++) {
+        int x = 0;
+        for(;x < CHIP8_WIDTH;x++) {
+            capture->gray[y][x] = (slot->display[y] >> (63 - x)) & 1 ? 0xFF : 0;
+        }
+    }
+
+    return fwrite(capture->gray, sizeof(capture->gray), 1, capture->file) == 1;
+}
+
+static void gif_flush_block(struct chip8_capture* capture) {
+    if(capture->gif_block_len) {
+        fputc(capture->gif_block_len, capture->file);
+        fwrite(capture->gif_block, 1, capture->gif_block_len, capture->file);
+        capture->gif_block_len = 0;
+    }
+}
+
+//LZW codes are packed least significant bit first into sub-blocks of at most 255 bytes
+static void gif_write_code(struct chip8_capture* capture, uint32_t code, int size) {
+    capture->gif_bits |= code << capture->gif_bit_count;
+    capture->gif_bit_count += size;
+
+    while(capture->gif_bit_count >= 8) {
+        capture->gif_block[capture->gif_block_len++] = capture->gif_bits & 0xFF;
+        capture->gif_bits >>= 8;
+        capture->gif_bit_count -= 8;
+        if(capture->gif_block_len == 255) {
+            gif_flush_block(capture);
+        }
+    }
+}
+
+/*
+    Writes the pending GIF frame, shown for delay hundredths of a second
+*/
+static bool write_gif_frame(struct chip8_capture* capture, unsigned delay) {
+    const uint32_t clear = 1 << GIF_MIN_CODE_SIZE;
+    int size = GIF_MIN_CODE_SIZE + 1;
+    uint32_t max_code = clear + 1;
+    int current = -1;
+    int y = 0;
+
+    //Graphic control extension with the delay, then the image descriptor covering the whole screen
+    const uint8_t header[] = {0x21, 0xF9, 4, 0, delay & 0xFF, delay >> 8, 0, 0,
+        0x2C, 0, 0, 0, 0, CHIP8_WIDTH, 0, CHIP8_HEIGHT, 0, 0, GIF_MIN_CODE_SIZE};
+    fwrite(header, sizeof(header), 1, capture->file);
+
+    memset(capture->gif_tree, 0, sizeof(capture->gif_tree));
+    capture->gif_bits = 0;
+    capture->gif_bit_count = 0;
+    gif_write_code(capture, clear, size);
+
+    //Two colour LZW, each code has at most two children
+    for(;y < CHIP8_HEIGHT;y++) {
+        int x = 0;
+        for(;x < CHIP8_WIDTH;x++) {
+            int pixel = (capture->gif_pending[y] >> (63 - x)) & 1;
+
+            if(current < 0) {
+                current = pixel;
+            }
+            else if(capture->gif_tree[current][pixel]) {
+                current = capture->gif_tree[current][pixel];
+            }
+            else {
+                gif_write_code(capture, current, size);
+                capture->gif_tree[current][pixel] = ++max_code;
+                if(max_code >= (1u << size)) {
+                    size++;
+                }
+                if(max_code == GIF_MAX_CODES - 1) {
+                    gif_write_code(capture, clear, size);
+                    memset(capture->gif_tree, 0, sizeof(capture->gif_tree));
+                    size = GIF_MIN_CODE_SIZE + 1;
+                    max_code = clear + 1;
+                }
+                current = pixel;
+            }
+        }
+    }
+
+    gif_write_code(capture, current, size);
+    //The decoder adds one more entry after the last code and may move to the next code size with it
+    if(++max_code >= (1u << size) && size < 12) {
+        size++;
+    }
+    gif_write_code(capture, clear + 1, size);
+    if(capture->gif_bit_count) {
+        gif_write_code(capture, 0, 8 - capture->gif_bit_count);
+    }
+    gif_flush_block(capture);
+    fputc(0, capture->file);
+
+    return !ferror(capture->file);
+}
+
+static unsigned centiseconds(uint64_t frame) {
+    return frame * 100 / FPS;
+}
+
+/*
+    Holds each GIF frame until the picture changes, so a still screen costs one frame
+*/
+static bool write_gif(struct chip8_capture* capture, const struct capture_slot* slot) {
+    bool ok = true;
+
+    capture->gif_last_frame = slot->frame;
+    if(capture->gif_has_pending && !memcmp(capture->gif_pending, slot->display, sizeof(slot->display))) {
+        return true;
+    }
+
+    if(capture->gif_has_pending) {
+        unsigned delay = centiseconds(slot->frame) - centiseconds(capture->gif_pending_frame);
+
+        //Too short for viewers, the pending picture is replaced but keeps its start time
+        if(delay < GIF_MIN_DELAY) {
+            memcpy(capture->gif_pending, slot->display, sizeof(slot->display));
+            return true;
+        }
+        ok = write_gif_frame(capture, delay);
+    }
+
+    memcpy(capture->gif_pending, slot->display, sizeof(slot->display));
+    capture->gif_pending_frame = slot->frame;
+    capture->gif_has_pending = true;
+    return ok;
+}
+
+static bool encode(struct chip8_capture* capture, const struct capture_slot* slot) {
+    switch(capture->format) {
+        case CAPTURE_RAW: return write_raw(capture, slot);
+        case CAPTURE_PNG: return write_png(capture, slot);
+        default: return write_gif(capture, slot);
+    }
+}
+
+/*
+    Background thread, encodes queued frames until stopped and the queue is empty
+*/
+static void* encoder(void* arg) {
+    struct chip8_capture* capture = arg;
+
+    pthread_mutex_lock(&capture->lock);
+    for(;;) {
+        while(capture->tail == capture->head && !capture->stopping) {
+            pthread_cond_wait(&capture->ready, &capture->lock);
+        }
+        if(capture->tail == capture->head) {
+            break;
+        }
+
+        //The slot is not reused until tail moves past it, so it is encoded without the lock
+        struct capture_slot* slot = &capture->pool[capture->tail % POOL_SIZE];
+        pthread_mutex_unlock(&capture->lock);
+
+        if(!encode(capture, slot) && DEBUG) {
+            printf("Couldn't write frame %llu\n", (unsigned long long) slot->frame);
+        }
+
+        pthread_mutex_lock(&capture->lock);
+        capture->tail++;
+        pthread_cond_signal(&capture->space);
+    }
+    pthread_mutex_unlock(&capture->lock);
+
+    return NULL;
+}
+
+/*
+    Picks the format from the file name: .gif, .raw or a PNG prefix for anything else
+*/
+enum capture_format capture_format_from_path(const char* path) {
+    const char* dot = strrchr(path, '.');
+
+    if(dot && !strcmp(dot, ".gif")) {
+        return CAPTURE_GIF;
+    }
+    if(dot && !strcmp(dot, ".raw")) {
+        return CAPTURE_RAW;
+    }
+    return CAPTURE_PNG;
+}
+
+/*
+    Starts the encoder thread
+    @param path File for RAW and GIF, file name prefix for PNG
+    @returns NULL if the file or thread couldn't be created
+*/
+struct chip8_capture* capture_start(const char* path, enum capture_format format) {
+    struct chip8_capture* capture = calloc(1, sizeof(*capture));
+
+    if(!capture || strlen(path) >= MAX_PATH) {
+        free(capture);
+        return NULL;
+    }
+
+    pthread_once(&crc_once, build_crc_table);
+    capture->format = format;
+    strcpy(capture->path, path);
+
+    if(format != CAPTURE_PNG && !(capture->file = fopen(path, "wb"))) {
+        free(capture);
+        return NULL;
+    }
+
+    if(format == CAPTURE_GIF) {
+        //Header, 64x32 screen with a two entry global colour table of black and white, looping forever
+        static const uint8_t header[] = {'G', 'I', 'F', '8', '9', 'a', CHIP8_WIDTH, 0, CHIP8_HEIGHT, 0, 0x80, 0, 0,
+            0, 0, 0, 0xFF, 0xFF, 0xFF,
+            0x21, 0xFF, 11, 'N', 'E', 'T', 'S', 'C', 'A', 'P', 'E', '2', '.', '0', 3, 1, 0, 0, 0};
+        fwrite(header, sizeof(header), 1, capture->file);
+    }
+
+    pthread_mutex_init(&capture->lock, NULL);
+    pthread_cond_init(&capture->ready, NULL);
+    pthread_cond_init(&capture->space, NULL);
+
+    if(pthread_create(&capture->thread, NULL, encoder, capture)) {
+        pthread_mutex_destroy(&capture->lock);
+        pthread_cond_destroy(&capture->ready);
+        pthread_cond_destroy(&capture->space);
+        if(capture->file) {
+            fclose(capture->file);
+        }
+        free(capture);
+        return NULL;
+    }
+
+    return capture;
+}
+
+/*
+    Queues the machine's framebuffer, called at the end of every frame. When the encoder is behind,
+    real time backends drop the frame and other backends wait, so headless videos have every frame.
+    @returns False if the frame was dropped
+*/
+bool capture_frame(struct chip8_capture* capture, const struct chip8_vm* vm) {
+    bool queued = false;
+
+    pthread_mutex_lock(&capture->lock);
+    while(!vm->io->realtime && capture->head - capture->tail >= POOL_SIZE) {
+        pthread_cond_wait(&capture->space, &capture->lock);
+    }
+
+    if(capture->head - capture->tail < POOL_SIZE) {
+        struct capture_slot* slot = &capture->pool[capture->head % POOL_SIZE];
+
+        memcpy(slot->display, vm->display, sizeof(slot->display));
+        slot->frame = vm->frames;
+        capture->head++;
+        queued = true;
+        pthread_cond_signal(&capture->ready);
+    }
+    else {
+        capture->dropped++;
+    }
+    pthread_mutex_unlock(&capture->lock);
+
+    return queued;
+}
+
+/*
+    Encodes the frames still queued, closes the output and frees the capture
+    @returns Number of frames dropped because the encoder fell behind
+*/
+uint64_t capture_stop(struct chip8_capture* capture) {
+    pthread_mutex_lock(&capture->lock);
+    capture->stopping = true;
+    pthread_cond_signal(&capture->ready);
+    pthread_mutex_unlock(&capture->lock);
+    pthread_join(capture->thread, NULL);
+
+    if(capture->format == CAPTURE_GIF) {
+        if(capture->gif_has_pending) {
+            unsigned delay = centiseconds(capture->gif_last_frame + 1) - centiseconds(capture->gif_pending_frame);
+            write_gif_frame(capture, delay > GIF_MIN_DELAY ? delay : GIF_MIN_DELAY);
+        }
+        fputc(0x3B, capture->file);
+    }
+
+    if(capture->file) {
+        fclose(capture->file);
+    }
+
+    uint64_t dropped = capture->dropped;
+    pthread_mutex_destroy(&capture->lock);
+    pthread_cond_destroy(&capture->ready);
+    pthread_cond_destroy(&capture->space);
+    free(capture);
+    return dropped;
+}
+
+#undef DEBUG
+#undef POOL_SIZE
+#undef MAX_PATH
+#undef FPS
+#undef ROW_BYTES
+#undef PNG_DATA
+#undef PNG_SIZE
+#undef GIF_MIN_DELAY
+#undef GIF_MIN_CODE_SIZE
+#undef GIF_MAX_CODES
@@ -0,0 +1,24 @@
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+struct chip8_vm;
+struct chip8_capture;
+
+enum capture_format {
+    //64x32 8 bit grayscale frames back to back, 60 per second
+    CAPTURE_RAW,
+    //One 64x32 1 bit PNG per frame, named <path>000001.png and so on
+    CAPTURE_PNG,
+    //Animated GIF, repeated frames are merged into longer ones
+    CAPTURE_GIF
+};
+
+enum capture_format capture_format_from_path(const char* path);
+struct chip8_capture* capture_start(const char* path, enum capture_format format);
+bool capture_frame(struct chip8_capture* capture, const struct chip8_vm* vm);
+uint64_t capture_stop(struct chip8_capture* capture);
+
+#endif
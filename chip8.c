@@ -1,28 +1,32 @@
+#define _POSIX_C_SOURCE 200809L
+#include <errno.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
 
-#include "display.h"
+#include "capture.h"
+#include "chip8.h"
+#include "instrument.h"
+#include "jit.h"
+#include "predecode.h"
+#include "profile.h"
+#include "replay.h"
+#include "romcache.h"
 
 #define DEBUG 0
-#define MEMORY_SIZE 4096
-#define MEMORY_OFFSET 512
+#define MEMORY_OFFSET CHIP8_ROM_ADDRESS
 #define NIBBLE(n) ((instruction >> (16 - n * 4)) & 0xF)
-
-uint8_t memory[MEMORY_SIZE];
-uint8_t* pc = memory + MEMORY_OFFSET;
-
-uint8_t registers[16];
-
-uint16_t index_register;
-
-uint8_t sound_timer = 0;
-uint8_t delay_timer = 0;
-
-//Stores locations in memory
-uint8_t* stack[16];
-uint8_t** stack_ptr = stack;
+#define INSTRUCTIONS_HZ 700
+#define TIMERS_HZ 60
+#define NS_PER_SEC 1000000000ULL
+//Frames the scheduler may fall behind before it gives up catching up
+#define MAX_LAG_FRAMES 4
+//ROMs with native code a process can register
+#define MAX_NATIVE 16
+//Native code tracks writes in 64 byte pages, one bit each
+#define NATIVE_PAGE_SHIFT 6
 
 const uint16_t const font[] = {
     0xF0, 0x90, 0x90, 0x90, 0xF0, // 0
@@ -43,36 +47,321 @@ const uint16_t const font[] = {
     0xF0, 0x80, 0xF0, 0x80, 0x80  // F
 };
 
+//Power on contents of every page until a ROM is loaded
+static const uint8_t zero_page[CHIP8_PAGE_SIZE];
+
+//Registered ahead of time compiled ROMs
+static const struct chip8_native* natives[MAX_NATIVE];
+static int num_natives;
+
+static uint64_t monotonic_ns(void) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * NS_PER_SEC + now.tv_nsec;
+}
+
+/*
+    Resets machine to power on state
+    @param vm Machine to reset
+    @param backend Display, input and audio device the machine runs on
+*/
+void chip8_init(struct chip8_vm* vm, const struct backend* backend) {
+    //Private memory is only read once a page is copied into it
+    memset(vm, 0, offsetof(struct chip8_vm, private_memory));
+
+    int i = 0;
+    for(;i < CHIP8_PAGES;i++) {
+        vm->pages[i] = zero_page;
+    }
+
+    vm->pc = MEMORY_OFFSET;
+    vm->key_up = CHIP8_NO_KEY;
+    vm->io = backend;
+    vm->turbo = 1;
+    vm->display_wait = backend->realtime;
+    chip8_seed(vm, 0);
+#ifdef CHIP8_INSTRUMENT
+    instrument_attach(vm);
+#endif
+}
+
+/*
+    Frees buffers owned by the machine, chip8_init can be called again afterwards
+*/
+void chip8_release(struct chip8_vm* vm) {
+    free(vm->decoded);
+    vm->decoded = NULL;
+
+    jit_destroy(vm->jit);
+    vm->jit = NULL;
+
+#ifdef CHIP8_INSTRUMENT
+    instrument_detach(vm);
+#endif
+}
+
+/*
+    Selects how instructions are executed
+    @param tier CHIP8_TIER_INTERPRETER for execute_instruction, CHIP8_TIER_PREDECODE for the decode cache,
+    CHIP8_TIER_JIT for native code with the decode cache as fallback
+    @returns False if the tier could not be set up, the machine keeps its previous tier
+*/
+bool chip8_set_tier(struct chip8_vm* vm, enum chip8_tier tier) {
+#ifdef CHIP8_INSTRUMENT
+    //Native blocks would run past the counters
+    if(tier == CHIP8_TIER_JIT) {
+        tier = CHIP8_TIER_PREDECODE;
+    }
+#endif
+
+    //Hosts without a code generator get the decode cache the JIT would fall back to
+    if(tier == CHIP8_TIER_JIT && !jit_supported()) {
+        tier = CHIP8_TIER_PREDECODE;
+    }
+
+    if(tier == CHIP8_TIER_JIT && !vm->jit) {
+        if(!(vm->jit = jit_create())) {
+            return false;
+        }
+    }
+
+    if(tier != CHIP8_TIER_INTERPRETER && !vm->decoded) {
+        if(!(vm->decoded = predecode_create())) {
+            return false;
+        }
+    }
+
+    if(tier == CHIP8_TIER_INTERPRETER) {
+        free(vm->decoded);
+        vm->decoded = NULL;
+    }
+    if(tier != CHIP8_TIER_JIT) {
+        jit_destroy(vm->jit);
+        vm->jit = NULL;
+    }
+
+    vm->tier = tier;
+    return true;
+}
+
+/*
+    Fills in the settings of a normal speed machine on the predecode tier
+*/
+void chip8_default_config(struct chip8_config* config) {
+    config->tier = CHIP8_TIER_PREDECODE;
+    config->cycles_per_frame = 0;
+    config->turbo = 1;
+    config->unthrottled = false;
+    config->display_wait = true;
+    config->seed = 0;
+}
+
+/*
+    Applies settings to a machine initialized with its backend
+    @param config Settings to apply
+*/
+void chip8_configure(struct chip8_vm* vm, const struct chip8_config* config) {
+    //A JIT that can't get executable memory drops to the decode cache, and the interpreter
+    //needs no setup and is the last fallback
+    if(!chip8_set_tier(vm, config->tier)) {
+        if(config->tier == CHIP8_TIER_JIT && chip8_set_tier(vm, CHIP8_TIER_PREDECODE)) {
+            if(DEBUG) {
+                printf("JIT not available, using the predecode tier\n");
+            }
+        }
+        else {
+            if(DEBUG) {
+                printf("Execution tier not available, using the interpreter\n");
+            }
+            chip8_set_tier(vm, CHIP8_TIER_INTERPRETER);
+        }
+    }
+
+    vm->cycles_per_frame = config->cycles_per_frame;
+    vm->turbo = config->turbo ? config->turbo : 1;
+    vm->unthrottled = config->unthrottled;
+    vm->display_wait = config->display_wait && vm->io->realtime && !config->unthrottled;
+    chip8_seed(vm, config->seed ? config->seed : monotonic_ns() ^ (uintptr_t) vm);
+}
+
+/*
+    Restarts the Cxkk generator
+    @param seed Any value, the same seed always gives the same sequence
+*/
+void chip8_seed(struct chip8_vm* vm, uint64_t seed) {
+    //splitmix64 spreads similar seeds apart and never gives the 0 state xorshift is stuck in
+    uint64_t z = seed + 0x9E3779B97F4A7C15ULL;
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    z ^= z >> 31;
+    vm->rng = z ? z : 1;
+}
+
+/*
+    Makes machines that load the ROM native was compiled from run its code. Call before any
+    machine loads a ROM, the list is not locked.
+    @returns False if too many are registered
+*/
+bool chip8_register_native(const struct chip8_native* native) {
+    if(num_natives == MAX_NATIVE) {
+        return false;
+    }
+
+    natives[num_natives++] = native;
+    return true;
+}
+
+/*
+    Attaches the native code compiled from the ROM just loaded, if any
+*/
+static void attach_native(struct chip8_vm* vm, const struct chip8_rom* rom) {
+    int i = 0;
+
+    vm->native = NULL;
+    vm->native_dirty = 0;
+    for(;i < num_natives;i++) {
+        if(natives[i]->hash == rom->hash && natives[i]->size == rom->size) {
+            vm->native = natives[i];
+        }
+    }
+}
+
 /*
     Loads file into Chip8 ROM file into memory 
+    @param vm Machine to load into
     @param filepath The filepath for the file that needs to be read  
+    @returns False if the file could not be read or does not fit in memory
 */
-static int initialize_file(char* filepath) {
-    FILE* file;
+bool chip8_load(struct chip8_vm* vm, const char* filepath) {
+    //Read once per process, later loads copy the cached memory image
+    const struct chip8_rom* rom = rom_cache_load(filepath);
 
-    if(!(file = fopen(filepath, "rb"))){
-        printf("Couldn't open file");
-        exit(-1);
+    if(!rom) {
+        if(DEBUG) {
+            printf("Couldn't open file");
+        }
+        return false;
     }
 
-    uint8_t buf;
-    uint8_t* it = memory + MEMORY_OFFSET;
-    while(fread(&buf, sizeof(uint8_t),1,file)) {
-        *it++ = buf;
+    chip8_load_image(vm, rom->image);
+    attach_native(vm, rom);
+    return true;
+}
+
+/*
+    Loads a ROM image that is already in memory
+    @param rom ROM bytes, loaded at 0x200
+    @param size Number of bytes, must fit below the end of memory
+    @returns False if the ROM is too large
+*/
+bool chip8_load_rom(struct chip8_vm* vm, const uint8_t* rom, size_t size) {
+    const struct chip8_rom* cached = rom_cache_insert(rom, size);
+
+    if(!cached) {
+        return false;
     }
 
-    if(ferror(file)){
-        printf("Reading file error");
-        fclose(file);
-        exit(-1);
+    chip8_load_image(vm, cached->image);
+    attach_native(vm, cached);
+    return true;
+}
+
+/*
+    Builds the power on memory of a ROM: the font, the ROM at 0x200 and zeros everywhere else
+    @param image Receives CHIP8_MEMORY_SIZE bytes
+    @returns False if the ROM doesn't fit above 0x200
+*/
+bool chip8_make_image(uint8_t* image, const uint8_t* rom, size_t size) {
+    if(size > CHIP8_MEMORY_SIZE - MEMORY_OFFSET) {
+        return false;
     }
 
-    fclose(file);
+    memset(image, 0, CHIP8_MEMORY_SIZE);
+    memcpy(image + MEMORY_OFFSET, rom, size);
 
-    //Loads font into memory
     int i = 0;
     for(;i < 80;i++) {
-        memory[i] = font[i];
+        image[i] = font[i];
+    }
+
+    return true;
+}
+
+/*
+    Replaces all of memory with an image built by chip8_make_image, native code is only kept by chip8_load.
+    The image is shared, not copied, so it must not change and must outlive the machine, as cached ROMs do.
+*/
+void chip8_load_image(struct chip8_vm* vm, const uint8_t* image) {
+    int i = 0;
+
+    for(;i < CHIP8_PAGES;i++) {
+        vm->pages[i] = image + i * CHIP8_PAGE_SIZE;
+    }
+    vm->private_pages = 0;
+
+    chip8_memory_written(vm, 0, CHIP8_MEMORY_SIZE);
+    vm->native = NULL;
+}
+
+/*
+    Gives the page holding address a private copy on its first write
+    @returns The byte at address, writable up to the end of its page
+*/
+uint8_t* chip8_writable(struct chip8_vm* vm, uint16_t address) {
+    int page;
+
+    address &= CHIP8_ADDRESS_MASK;
+    page = address >> CHIP8_PAGE_SHIFT;
+
+    if(!(vm->private_pages & (1 << page))) {
+        uint8_t* copy = vm->private_memory + (page << CHIP8_PAGE_SHIFT);
+
+        memcpy(copy, vm->pages[page], CHIP8_PAGE_SIZE);
+        vm->pages[page] = copy;
+        vm->private_pages |= 1 << page;
+    }
+
+    return vm->private_memory + address;
+}
+
+/*
+    Copies all of memory out of its pages
+    @param out Receives CHIP8_MEMORY_SIZE bytes
+*/
+void chip8_copy_memory(const struct chip8_vm* vm, uint8_t* out) {
+    int i = 0;
+
+    for(;i < CHIP8_PAGES;i++) {
+        memcpy(out + i * CHIP8_PAGE_SIZE, vm->pages[i], CHIP8_PAGE_SIZE);
+    }
+}
+
+/*
+    Must be called after anything writes to machine memory so cached decodes of it are dropped
+    @param address First byte written
+    @param length Number of bytes written
+*/
+void chip8_memory_written(struct chip8_vm* vm, uint16_t address, uint16_t length) {
+    if(vm->decoded) {
+        predecode_invalidate(vm->decoded, address, length);
+    }
+
+    if(vm->jit) {
+        jit_invalidate(vm->jit, address, length);
+    }
+
+    if(vm->native && length) {
+        int first = (address & CHIP8_ADDRESS_MASK) >> NATIVE_PAGE_SHIFT;
+        int last = ((address + length - 1) & CHIP8_ADDRESS_MASK) >> NATIVE_PAGE_SHIFT;
+
+        //A write that wraps past the end of memory or covers all of it
+        if(last < first || length >= CHIP8_MEMORY_SIZE) {
+            vm->native_dirty = ~0ULL;
+        }
+        else {
+            vm->native_dirty |= (~0ULL >> (63 - last)) & (~0ULL << first);
+        }
     }
 }
 
@@ -80,29 +369,145 @@ static int initialize_file(char* filepath) {
     Reads instruction and increments program counter 
     @returns The instruction at the program counter
 */
-static uint16_t fetch(void) {
-    //First byte
-    uint16_t t1 = *pc++ << 8;
-    //Second byte
-    uint16_t t2 =  *pc++;
+static uint16_t fetch(struct chip8_vm* vm) {
+    uint16_t instruction = chip8_instruction_at(vm, vm->pc);
+
+    vm->pc = (vm->pc + 2) & CHIP8_ADDRESS_MASK;
+    return instruction;
+}
+
+/*
+    Clears display bitmap, the screen is updated at the end of the frame
+*/
+void chip8_clear_screen(struct chip8_vm* vm) {
+    memset(vm->display, 0, sizeof(vm->display));
+    vm->dirty_rows = ~(uint32_t) 0;
+}
+
+/*
+    Draws the sprite at the index register, sets VF on collision
+    @param vx Register holding the x coordinate
+    @param vy Register holding the y coordinate
+    @param length Sprite height in rows
+    @returns False if the 60 frame cap has not passed yet and the instruction must be retried
+*/
+bool chip8_draw_sprite(struct chip8_vm* vm, uint8_t vx, uint8_t vy, uint8_t length) {
+    //60 frame cap, one sprite per frame
+    if(vm->display_wait) {
+        if(!vm->vblank) {
+            CHIP8_INSTRUMENT_STALL(vm);
+            return false;
+        }
+        vm->vblank = false;
+    }
+
+    uint8_t x = vm->registers[vx] & 63;
+    uint8_t y = vm->registers[vy] & 31;
+    uint64_t collision = 0;
+
+    int j = 0;
+    for(;j < length && y + j < CHIP8_HEIGHT;j++) {
+        //Sprite stored at index register, shifted into place. Bits past the right edge fall off.
+        uint64_t row = (uint64_t) chip8_read(vm, vm->index_register + j) << 56 >> x;
+
+        collision |= vm->display[y + j] & row;
+        vm->display[y + j] ^= row;
+    }
+
+    vm->registers[15] = collision != 0;
+    CHIP8_INSTRUMENT_SPRITE(vm, j, collision != 0);
+
+    //Rows y to y + j - 1 changed, the screen is updated at the end of the frame
+    if(j) {
+        vm->dirty_rows |= (uint32_t) (((uint64_t) 1 << j) - 1) << y;
+    }
+    return true;
+}
+
+/*
+    Gets status of key (pressed or depressed). Status updated by the backend.
+    @param key Hexadecimal of key to get status of
+    @returns true if key is pressed down and otherwise false
+*/
+bool chip8_key_down(struct chip8_vm* vm, uint8_t key) {
+    return (atomic_load_explicit(&vm->keypad, memory_order_relaxed) >> (key & 0xF)) & 1;
+}
+
+/*
+    Checks if any key was depressed. Status updated by the backend.
+    @param key Sets key to the latest key(hexadecimal) that was depressed
+    @returns True if any key was depressed
+*/
+bool chip8_key_pressed(struct chip8_vm* vm, uint8_t* key) {
+    if(vm->key_up != CHIP8_NO_KEY) {
+        if(key) {
+            *key = vm->key_up;
+        }
+
+        vm->key_up = CHIP8_NO_KEY;
+        return true;
+    }
+    
+    return false;
+}
+
+/*
+    Writes the decimal digits of register x to memory at the index register
+*/
+void chip8_store_bcd(struct chip8_vm* vm, uint8_t x) {
+    uint8_t temp = vm->registers[x];
+
+    int i = 2;
+    for(;i >= 0;i--) {
+        *chip8_writable(vm, vm->index_register + i) = temp % 10;
+        temp /= 10;
+    }
+
+    chip8_memory_written(vm, vm->index_register & CHIP8_ADDRESS_MASK, 3);
+}
+
+/*
+    Writes registers 0 to x to memory at the index register and moves the index register past them
+*/
+void chip8_store_registers(struct chip8_vm* vm, uint8_t x) {
+    uint8_t i = 0;
 
-    return t1 | t2;
+    for(;i <= x;i++) {
+        *chip8_writable(vm, vm->index_register + i) = vm->registers[i];
+    }
+
+    chip8_memory_written(vm, vm->index_register & CHIP8_ADDRESS_MASK, x + 1);
+    vm->index_register += x + 1;
+}
+
+/*
+    Reads registers 0 to x from memory at the index register and moves the index register past them
+*/
+void chip8_load_registers(struct chip8_vm* vm, uint8_t x) {
+    uint8_t i = 0;
+
+    for(;i <= x;i++) {
+        vm->registers[i] = chip8_read(vm, vm->index_register + i);
+    }
+
+    vm->index_register += x + 1;
 }
 
 /*
     Executes instruction or ignores it
+    @param vm Machine to execute on
     @param Chip8 instruction to execute
 */
-void execute_instruction(uint16_t instruction){
+void execute_instruction(struct chip8_vm* vm, uint16_t instruction){
 
     switch (NIBBLE(1)) {
         case 0x0:
             if(instruction == 0xE0) {
-                clear_screen();
+                chip8_clear_screen(vm);
             }
             //Pop Stack Instruction
             else if(instruction == 0xEE) {
-                pc = *--stack_ptr; 
+                vm->pc = vm->stack[--vm->stack_ptr & 0xF]; 
             }
             else if(DEBUG) {
                 printf("\nInstruction not found: %x\n", instruction);
@@ -111,45 +516,45 @@ void execute_instruction(uint16_t instruction){
 
         //Jump Instruction
         case 0x1:
-            pc = memory + (instruction & 0xFFF);
+            vm->pc = instruction & 0xFFF;
             break;
         
         //Push Stack and Jump Instruction
         case 0x2:
-            *stack_ptr++ = pc;
-            pc = memory + (instruction & 0xFFF);
+            vm->stack[vm->stack_ptr++ & 0xF] = vm->pc;
+            vm->pc = instruction & 0xFFF;
             break;
 
         //Skip Instructions(0x3, 0x4, 0x5)
         case 0x3:
             //Skip if the second nibble register equals the last two nibbles 
-            if(registers[NIBBLE(2)] == (instruction & 0xFF)) {
-                pc += 2 ;
+            if(vm->registers[NIBBLE(2)] == (instruction & 0xFF)) {
+                vm->pc = (vm->pc + 2) & CHIP8_ADDRESS_MASK;
             }
             break;
         
         case 0x4:
             //Skip if the second nibble register does not equal the last two nibbles 
-            if(registers[NIBBLE(2)] != (instruction & 0xFF)){
-                pc += 2 ;
+            if(vm->registers[NIBBLE(2)] != (instruction & 0xFF)){
+                vm->pc = (vm->pc + 2) & CHIP8_ADDRESS_MASK;
             }
             break;
         
         case 0x5:
             //Skip if the second nibble register equals the third nibble register
-            if(registers[NIBBLE(2)] == registers[NIBBLE(3)]){
-                pc += 2;
+            if(vm->registers[NIBBLE(2)] == vm->registers[NIBBLE(3)]){
+                vm->pc = (vm->pc + 2) & CHIP8_ADDRESS_MASK;
             }
             break;
 
         //Set Register Instruction
         case 0x6:
-            registers[NIBBLE(2)] = (instruction & 0xFF);
+            vm->registers[NIBBLE(2)] = (instruction & 0xFF);
             break;
         
         //Add Register Instruction
         case 0x7:
-            registers[NIBBLE(2)] += (instruction & 0xFF);
+            vm->registers[NIBBLE(2)] += (instruction & 0xFF);
             break;
 
         case 0x8:
@@ -157,69 +562,69 @@ void execute_instruction(uint16_t instruction){
                 //Set Register Instruction 
                 case 0x0:
                     //Sets third nibble register to second nibble register
-                    registers[NIBBLE(2)] = registers[NIBBLE(3)];
+                    vm->registers[NIBBLE(2)] = vm->registers[NIBBLE(3)];
                     break;
                 //OR Register Instruction
                 case 0x1:
-                    registers[NIBBLE(2)] = registers[NIBBLE(2)] | registers[NIBBLE(3)];
-                    registers[15] = 0;
+                    vm->registers[NIBBLE(2)] = vm->registers[NIBBLE(2)] | vm->registers[NIBBLE(3)];
+                    vm->registers[15] = 0;
                     break;
                 
                 //AND Register Instruction
                 case 0x2:
-                    registers[NIBBLE(2)] = registers[NIBBLE(2)] & registers[NIBBLE(3)];
-                    registers[15] = 0;
+                    vm->registers[NIBBLE(2)] = vm->registers[NIBBLE(2)] & vm->registers[NIBBLE(3)];
+                    vm->registers[15] = 0;
                     break;
                 
                 //XOR Register Instruction
                 case 0x3:
-                    registers[NIBBLE(2)] = registers[NIBBLE(2)] ^ registers[NIBBLE(3)];
-                    registers[15] = 0;
+                    vm->registers[NIBBLE(2)] = vm->registers[NIBBLE(2)] ^ vm->registers[NIBBLE(3)];
+                    vm->registers[15] = 0;
                     break;
 
                 //ADD Register Instruction
                 case 0x4: {
-                    uint16_t temp = registers[NIBBLE(2)] + registers[NIBBLE(3)];
-                    registers[NIBBLE(2)] = temp & 0xFF;
-                    registers[15] = temp >= 256;
+                    uint16_t temp = vm->registers[NIBBLE(2)] + vm->registers[NIBBLE(3)];
+                    vm->registers[NIBBLE(2)] = temp & 0xFF;
+                    vm->registers[15] = temp >= 256;
                     break;
                 }
 
                 //SUB Register(second nibble - third nibble) Instruction 
                 case 0x5: {
-                    int16_t temp = registers[NIBBLE(2)] - registers[NIBBLE(3)];
-                    registers[NIBBLE(2)] = temp;
-                    registers[15] = temp >= 0;
+                    int16_t temp = vm->registers[NIBBLE(2)] - vm->registers[NIBBLE(3)];
+                    vm->registers[NIBBLE(2)] = temp;
+                    vm->registers[15] = temp >= 0;
                     break;
                 }
 
                 //SUB Register(third nibble - second nibble) Instruction
                 case 0x7: {
-                    int16_t temp = registers[NIBBLE(3)] - registers[NIBBLE(2)];
-                    registers[NIBBLE(2)] = temp;
-                    registers[15] = temp >= 0;
+                    int16_t temp = vm->registers[NIBBLE(3)] - vm->registers[NIBBLE(2)];
+                    vm->registers[NIBBLE(2)] = temp;
+                    vm->registers[15] = temp >= 0;
                     break;
                 }
                 
                 //RIGHT SHIFT Instruction
                 case 0x6: {
-                    bool temp = registers[NIBBLE(3)] & 0x1;
+                    bool temp = vm->registers[NIBBLE(3)] & 0x1;
 
-                    registers[NIBBLE(2)] = registers[NIBBLE(3)];
-                    registers[NIBBLE(2)] >>= 1;
+                    vm->registers[NIBBLE(2)] = vm->registers[NIBBLE(3)];
+                    vm->registers[NIBBLE(2)] >>= 1;
 
-                    registers[15] = temp;  
+                    vm->registers[15] = temp;  
                     break;
                 }
                 
                 //LEFT SHIFT Instruction
                 case 0xE: {
-                    bool temp = registers[NIBBLE(3)] >> 7;
+                    bool temp = vm->registers[NIBBLE(3)] >> 7;
 
-                    registers[NIBBLE(2)] = registers[NIBBLE(3)];
-                    registers[NIBBLE(2)] <<= 1;
+                    vm->registers[NIBBLE(2)] = vm->registers[NIBBLE(3)];
+                    vm->registers[NIBBLE(2)] <<= 1;
 
-                    registers[15] = temp;
+                    vm->registers[15] = temp;
                     break;
                 }
                     
@@ -234,75 +639,48 @@ void execute_instruction(uint16_t instruction){
 
         //Register NOT Compare Instruction
         case 0x9:
-            if(registers[NIBBLE(2)] != registers[NIBBLE(3)]) {
-                pc += 2;
+            if(vm->registers[NIBBLE(2)] != vm->registers[NIBBLE(3)]) {
+                vm->pc = (vm->pc + 2) & CHIP8_ADDRESS_MASK;
             }
             break;
         
         //Set Index Register Instruction
         case 0xA:
-            index_register = instruction & 0xFFF;
+            vm->index_register = instruction & 0xFFF;
             break;
         
         //Jump with Offset Instruction
         case 0xB:
-            pc = memory + (registers[0] + (instruction & 0xFFF));
+            vm->pc = (vm->registers[0] + (instruction & 0xFFF)) & CHIP8_ADDRESS_MASK;
             break;
         
         //Random Instruction
         case 0xC:
-            registers[NIBBLE(2)] = ((uint8_t)(rand() % 256)) & (instruction & 0xFF);
+            vm->registers[NIBBLE(2)] = chip8_random(vm) & (instruction & 0xFF);
             break;
         
         //Draw Sprite
-        case 0xD: {
+        case 0xD:
             //60 frame cap
-            if(!frame_drawn()) {
-                pc -= 2;
-                break;
-            }
-
-            uint8_t x = registers[NIBBLE(2)] & 63;
-            uint8_t y = registers[NIBBLE(3)] & 31;
-            uint8_t length = NIBBLE(4);
-
-            registers[15] = 0;
-
-            int j = 0;
-            for(;j < length && y + j < 32;j++) {
-                
-                //Sprite stored at index register
-                uint8_t row = memory[index_register + j];
-
-                int i = 0;
-                for(;i < 8 && x + i < 64;i++) {
-                    //Each bit represents either a black or white pixel
-                    if((row >> (7 - i)) & 0x1) {
-                        if(toggle_pixel(x + i,y + j)) {
-                            registers[15] = 1;
-                        }
-                    }
-                }
+            if(!chip8_draw_sprite(vm, NIBBLE(2), NIBBLE(3), NIBBLE(4))) {
+                vm->pc = (vm->pc - 2) & CHIP8_ADDRESS_MASK;
             }
-
-            draw();
             break;
-        }
         
         case 0xE:
             switch (instruction & 0xF)
             {
                 //Skip if Key Down Instruction
                 case 0xE:
-                    if(key_down(registers[NIBBLE(2)])) {
-                        pc += 2;
+                    if(chip8_key_down(vm, vm->registers[NIBBLE(2)])) {
+                        vm->pc = (vm->pc + 2) & CHIP8_ADDRESS_MASK;
                     }
                     break;
 
                 //Skip if Not Key Down Instruction
                 case 0x1:
-                    if(!key_down(registers[NIBBLE(2)])) {
-                        pc += 2;
+                    if(!chip8_key_down(vm, vm->registers[NIBBLE(2)])) {
+                        vm->pc = (vm->pc + 2) & CHIP8_ADDRESS_MASK;
                     }
                     break;
                 
@@ -318,76 +696,53 @@ void execute_instruction(uint16_t instruction){
             switch (instruction & 0xFF) {
                 //Read Delay Timer Instruction
                 case 0x7:
-                    registers[NIBBLE(2)] = delay_timer;
+                    vm->registers[NIBBLE(2)] = vm->delay_timer;
                     break;
                 
                 //Set Delay Timer Instruction
                 case 0x15:
-                    delay_timer = registers[NIBBLE(2)];
+                    vm->delay_timer = vm->registers[NIBBLE(2)];
                     break;
 
                 //Set Sound Timer Instruction
                 case 0x18:
-                    sound_timer = registers[NIBBLE(2)];
+                    vm->sound_timer = vm->registers[NIBBLE(2)];
                     break;
 
                 //Add Index Register Instruction
                 case 0x1E: {
-                    index_register += registers[NIBBLE(2)];
-                    registers[15] = index_register > 0xFFF;
+                    vm->index_register += vm->registers[NIBBLE(2)];
+                    vm->registers[15] = vm->index_register > 0xFFF;
                     break;
                 }
                 //Skip if Any Key Not Pressed
                 case 0xA:
                     //Writes to nibble 2 register what key was pressed
-                    if(!key_pressed(&(registers[NIBBLE(2)]))) {
-                        pc -= 2;
+                    if(!chip8_key_pressed(vm, &(vm->registers[NIBBLE(2)]))) {
+                        vm->pc = (vm->pc - 2) & CHIP8_ADDRESS_MASK;
                     }
                     break;
 
                 //Set Index Register to Font Character
                 case 0x29: 
-                    //Font characters start at memory 0 and are 5 bytes in size
-                    index_register = registers[(NIBBLE(2))] * 5;
+                    //Font characters start at vm->memory 0 and are 5 bytes in size
+                    vm->index_register = vm->registers[(NIBBLE(2))] * 5;
                     break;
 
                 //Binary-coded Decimal Conversion Instruction
-                case 0x33: {
-                    uint8_t temp = registers[NIBBLE(2)];
-
-                    int i = 2;
-                    for(;i >= 0;i--) {
-                        memory[index_register + i] = temp % 10;
-                        temp /= 10;
-                    }
+                case 0x33:
+                    chip8_store_bcd(vm, NIBBLE(2));
                     break;
-                }
 
                 //Store Memory Instruction
-                case 0x55: {
-                    uint8_t i = 0;
-                    uint8_t x = (NIBBLE(2));
-
-                    for(;i <= x;i++) {
-                        memory[index_register + i] = registers[i];
-                    }
-
-                    index_register += x + 1;
+                case 0x55:
+                    chip8_store_registers(vm, NIBBLE(2));
                     break;
-                }
                 
                 //Load Memory Instruction
-                case 0x65: {
-                    uint8_t i = 0;
-                    uint8_t x = (NIBBLE(2));
-
-                    for(;i <= x;i++) {
-                        registers[i] = memory[index_register + i];
-                    }
-
-                    index_register += x + 1;
+                case 0x65:
+                    chip8_load_registers(vm, NIBBLE(2));
                     break;
-                } 
 
                 default:
                     if(DEBUG) {
@@ -406,66 +761,347 @@ void execute_instruction(uint16_t instruction){
 }
 
 /*
-    Run Chip8 ROM at filepath
-    @param filepath Path to ROM
+    Decrements the sound and delay timers, called once per frame
 */
-void run_chip(char* filepath) {
-    //Current time
-    struct timespec cur;
-    //time for when the sound and delay timers where decremented last
-    struct timespec past_timers;
-    //time for when the main loop was executed last
-    struct timespec past_main;
+static void tick_timers(struct chip8_vm* vm) {
+    //The tone sounds for every frame the timer is above zero
+    vm->io->set_sound(vm, vm->sound_timer > 0);
+    if(vm->sound_timer > 0) {
+        vm->sound_timer--;
+    }
 
-    initialize_file(filepath);
-    if(!initialize_display()) {
-        if(DEBUG) {
-            printf("Display not initialized\n");
+    if(vm->delay_timer > 0) {
+        vm->delay_timer--;
+    }
+
+    vm->frames++;
+}
+
+#ifndef CHIP8_INSTRUMENT
+/*
+    @param start Address of a possible Fx07 3xkk 1nnn or Fx07 4xkk 1nnn loop
+    @returns True if start holds a loop reading the delay timer until it reaches (3xkk) or leaves (4xkk) kk
+*/
+static bool delay_loop(const struct chip8_vm* vm, uint16_t start) {
+    uint16_t read = chip8_instruction_at(vm, start);
+    uint16_t test = chip8_instruction_at(vm, start + 2);
+    uint16_t jump = chip8_instruction_at(vm, start + 4);
+
+    return (read & 0xF0FF) == 0xF007 && ((test >> 12) == 0x3 || (test >> 12) == 0x4)
+        && (test & 0x0F00) == (read & 0x0F00) && jump == (0x1000 | (start & CHIP8_ADDRESS_MASK));
+}
+#endif
+
+/*
+    Recognizes a machine waiting for the next frame: a jump to itself, Fx0A with no key released,
+    a sprite held back by the display wait, or a loop polling the delay timer. Nothing these read
+    changes before the frame ends, so the rest of the frame is spent at once and the registers and
+    program counter are left where running it would have left them.
+    Instrumented and profiled machines count every instruction and are never skipped.
+    @param count Instructions left in the frame
+    @returns Instructions spent, the caller counts them as cycles
+*/
+uint64_t chip8_skip_idle(struct chip8_vm* vm, uint64_t count) {
+#ifdef CHIP8_INSTRUMENT
+    (void) vm;
+    (void) count;
+    return 0;
+#else
+    uint16_t instruction = chip8_instruction_at(vm, vm->pc);
+    uint16_t start = vm->pc;
+    uint64_t spent = 0;
+
+    if(!count || vm->profile) {
+        return 0;
+    }
+
+    switch(NIBBLE(1)) {
+        case 0x1:
+            if((instruction & 0xFFF) == vm->pc) {
+                return count;
+            }
+            break;
+
+        case 0xD:
+            return vm->display_wait && !vm->vblank ? count : 0;
+
+        case 0xF:
+            if((instruction & 0xFF) == 0x0A) {
+                return vm->key_up == CHIP8_NO_KEY ? count : 0;
+            }
+            break;
+    }
+
+    //Inside a delay loop, run the test and the jump back to its start
+    if(!delay_loop(vm, start)) {
+        start = (vm->pc - 2) & CHIP8_ADDRESS_MASK;
+        if(!delay_loop(vm, start)) {
+            start = (vm->pc - 4) & CHIP8_ADDRESS_MASK;
+            if(!delay_loop(vm, start)) {
+                return 0;
+            }
         }
-        exit(-1);
     }
-    
-    timespec_get(&past_timers, TIME_UTC);
-    timespec_get(&past_main, TIME_UTC);
 
-    srand(time(NULL));
+    uint16_t test = chip8_instruction_at(vm, start + 2);
+    uint8_t x = (test >> 8) & 0xF;
+    bool equal_exits = (test >> 12) == 0x3;
 
-    while(true){
-        timespec_get(&cur, TIME_UTC);
+    if(vm->pc == ((start + 2) & CHIP8_ADDRESS_MASK)) {
+        //The test leaves the loop, the tier runs it
+        if((vm->registers[x] == (test & 0xFF)) == equal_exits) {
+            return 0;
+        }
+        vm->pc = (start + 4) & CHIP8_ADDRESS_MASK;
+        spent++;
+    }
+    if(vm->pc == ((start + 4) & CHIP8_ADDRESS_MASK) && spent < count) {
+        vm->pc = start;
+        spent++;
+    }
 
-        //Timers are decremented at 60 Hz
-        if((cur.tv_sec - past_timers.tv_sec) + (cur.tv_nsec - past_timers.tv_nsec) / 1000000000.0 > (1.0 / 60)) { 
+    //The timer leaves the loop this frame or the budget ran out on the way back
+    if(vm->pc != start || spent == count || (vm->delay_timer == (test & 0xFF)) == equal_exits) {
+        return spent;
+    }
 
-            if(sound_timer > 0) {
-                sound_timer--;
-                play_beep();
-                
+    //Every pass reads the same timer value and takes the jump back
+    count -= spent;
+    vm->registers[x] = vm->delay_timer;
+    vm->pc = (start + 2 * (count % 3)) & CHIP8_ADDRESS_MASK;
+    return spent + count;
+#endif
+}
+
+/*
+    Executes instructions with the machine's tier
+    @param count Number of instructions to execute
+*/
+void chip8_execute(struct chip8_vm* vm, uint64_t count) {
+    //A machine still waiting from the last frame skips it, the interpreter stays the reference
+    if(vm->tier != CHIP8_TIER_INTERPRETER) {
+        uint64_t idle = chip8_skip_idle(vm, count);
+
+        vm->cycles += idle;
+        count -= idle;
+    }
+
+#ifndef CHIP8_INSTRUMENT
+    //Ahead of time code replaces the faster tiers, the interpreter stays the reference
+    if(vm->native && vm->tier != CHIP8_TIER_INTERPRETER) {
+        vm->native->run(vm, count);
+        return;
+    }
+#endif
+
+    if(vm->tier == CHIP8_TIER_JIT) {
+        jit_run(vm, count);
+        return;
+    }
+
+    if(vm->tier == CHIP8_TIER_PREDECODE) {
+        predecode_run(vm, count);
+        return;
+    }
+
+    vm->cycles += count;
+    for(;count;count--) {
+        CHIP8_INSTRUMENT_INSTRUCTION(vm, vm->pc & CHIP8_ADDRESS_MASK);
+        if(vm->profile) {
+            profile_instruction(vm->profile, vm);
+        }
+        uint16_t instruction = fetch(vm);
+        execute_instruction(vm, instruction);
+    }
+}
+
+/*
+    @returns The number of instructions due in the machine's next frame
+*/
+uint64_t chip8_frame_instructions(const struct chip8_vm* vm) {
+    uint64_t count = vm->cycles_per_frame;
+
+    //Default 700 Hz spread over frames as 11 or 12 instructions
+    if(!count) {
+        count = ((vm->frames + 1) * INSTRUCTIONS_HZ + TIMERS_HZ - 1) / TIMERS_HZ - (vm->frames * INSTRUCTIONS_HZ + TIMERS_HZ - 1) / TIMERS_HZ;
+    }
+
+    return count;
+}
+
+/*
+    @param count Instructions about to run
+    @returns count, or the instructions left before the cycle limit if that comes first
+*/
+uint64_t chip8_limit_instructions(const struct chip8_vm* vm, uint64_t count) {
+    if(!vm->cycle_limit) {
+        return count;
+    }
+    if(vm->cycles >= vm->cycle_limit) {
+        return 0;
+    }
+
+    return count < vm->cycle_limit - vm->cycles ? count : vm->cycle_limit - vm->cycles;
+}
+
+/*
+    Runs one 60 Hz frame: the instructions due this frame, then the timers.
+    A frame cut short by the cycle limit stops before its timers.
+    The backend presents separately, see chip8_run.
+*/
+void chip8_run_frame(struct chip8_vm* vm) {
+    uint64_t due = chip8_frame_instructions(vm);
+    uint64_t count = chip8_limit_instructions(vm, due);
+
+    //A new frame lets one sprite be drawn when the display wait is on
+    vm->vblank = true;
+
+    chip8_execute(vm, count);
+    if(count == due) {
+        chip8_end_frame(vm);
+    }
+}
+
+/*
+    Finishes a frame once its instructions have run: the timers, then instrumentation and capture
+*/
+void chip8_end_frame(struct chip8_vm* vm) {
+    tick_timers(vm);
+    CHIP8_INSTRUMENT_FRAME(vm);
+
+    if(vm->capture) {
+        capture_frame(vm->capture, vm);
+    }
+}
+
+/*
+    Sleeps until frame number frame is due. Deadlines are computed from the start time
+    so rounding never accumulates, and a late frame is made up by not sleeping.
+    @param start Time frame 0 was due, reset if the scheduler falls too far behind
+    @param frame Frames since start
+    @returns Frames since start after a reset
+*/
+static uint64_t wait_for_frame(uint64_t* start, uint64_t frame) {
+    uint64_t deadline = *start + frame * NS_PER_SEC / TIMERS_HZ;
+    uint64_t now = monotonic_ns();
+
+    //Too far behind to catch up, e.g. after the process was suspended. Start again from now.
+    if(now > deadline + MAX_LAG_FRAMES * NS_PER_SEC / TIMERS_HZ) {
+        *start = now;
+        return 0;
+    }
+
+    struct timespec wake = {deadline / NS_PER_SEC, deadline % NS_PER_SEC};
+    while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &wake, NULL) == EINTR);
+
+    return frame;
+}
+
+/*
+    Runs an initialized and loaded machine until its backend stops it.
+    Real time backends run vm->turbo frames every 1/60 s and sleep in between.
+    Unthrottled machines and other backends run frames back to back, presenting at most every 1/60 s.
+    @param vm Machine to run
+*/
+void chip8_run(struct chip8_vm* vm) {
+    uint64_t start = monotonic_ns();
+    uint64_t frame = 0;
+    bool running = true;
+
+    if(!vm->io->realtime || vm->unthrottled) {
+        uint64_t next_present = start;
+
+        //All GUI events, once per frame
+        while(vm->io->handle_events(vm)) {
+            if(vm->recording) {
+                input_log_capture(vm->recording, vm);
             }
+            chip8_run_frame(vm);
 
-            if(delay_timer > 0) {
-                delay_timer--;
+            //Checking the clock every frame is cheap next to the frame itself
+            if(vm->dirty_rows && monotonic_ns() >= next_present) {
+                vm->io->draw(vm);
+                next_present = monotonic_ns() + NS_PER_SEC / TIMERS_HZ;
             }
+        }
+
+        vm->io->draw(vm);
+        return;
+    }
 
-            past_timers = cur;
+    while(running) {
+        //Fast forward runs several frames per 1/60 s, with one present
+        unsigned i = 0;
+        for(;i < vm->turbo && running;i++) {
+            //All GUI events, once per frame
+            if((running = vm->io->handle_events(vm))) {
+                if(vm->recording) {
+                    input_log_capture(vm->recording, vm);
+                }
+                chip8_run_frame(vm);
+            }
         }
 
-        //Main loop executes at 700 Hz
-        if((cur.tv_sec - past_main.tv_sec) + (cur.tv_nsec - past_main.tv_nsec) / 1000000000.0 > (1.0 / 700)) {
+        vm->io->draw(vm);
+        frame = wait_for_frame(&start, frame + 1);
+    }
+}
 
-            uint16_t instruction = fetch();
-            execute_instruction(instruction);
+/*
+    Run Chip8 ROM at filepath
+    @param filepath Path to ROM
+    @param backend Display, input and audio device to run on
+    @param config Execution tier and pacing
+    @param session Recorders to attach, may be NULL
+*/
+void run_chip(char* filepath, const struct backend* backend, const struct chip8_config* config, const struct chip8_session* session) {
+    struct chip8_vm* vm = malloc(sizeof(*vm));
+
+    chip8_init(vm, backend);
+    chip8_configure(vm, config);
 
-            past_main = cur;
+    if(!chip8_load(vm, filepath)) {
+        printf("Couldn't open file");
+        exit(-1);
+    }
 
-            //All GUI events
-            handle_events();
+    if(!vm->io->initialize(vm)) {
+        if(DEBUG) {
+            printf("Display not initialized\n");
         }
+        exit(-1);
+    }
+
+    if(session && session->record) {
+        input_log_start(session->record, vm);
+    }
+    if(session && session->profile) {
+        profile_start(session->profile, vm);
+    }
+    if(session) {
+        vm->capture = session->capture;
+    }
+
+    chip8_run(vm);
+
+    if(session && session->record) {
+        input_log_stop(session->record, vm);
+    }
+    if(session && session->profile) {
+        profile_stop(session->profile, vm);
     }
 
-    close_display();
+    vm->io->close(vm);
+    chip8_release(vm);
+    free(vm);
 }
 
 #undef DEBUG
-#undef MEMORY_SIZE
 #undef MEMORY_OFFSET
 #undef NIBBLE
+#undef INSTRUCTIONS_HZ
+#undef TIMERS_HZ
+#undef NS_PER_SEC
+#undef MAX_LAG_FRAMES
+#undef MAX_NATIVE
+#undef NATIVE_PAGE_SHIFT
\ No newline at end of file
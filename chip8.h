@@ -1,7 +1,222 @@
 #ifndef CHIP8_H
 #define CHIP8_H
 
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
-void run_chip(char* filepath);
+#include "backend.h"
 
-#endif
\ No newline at end of file
+#define CHIP8_MEMORY_SIZE 4096
+#define CHIP8_WIDTH 64
+#define CHIP8_HEIGHT 32
+#define CHIP8_NUM_KEYS 16
+#define CHIP8_NO_KEY 16
+#define CHIP8_ADDRESS_MASK 0xFFF
+//Memory is split into pages that machines running the same ROM share until they write to them
+#define CHIP8_PAGE_SHIFT 8
+#define CHIP8_PAGE_SIZE (1 << CHIP8_PAGE_SHIFT)
+#define CHIP8_PAGES (CHIP8_MEMORY_SIZE / CHIP8_PAGE_SIZE)
+//Where ROMs are loaded and execution starts
+#define CHIP8_ROM_ADDRESS 0x200
+
+struct chip8_decoded;
+struct chip8_jit;
+struct chip8_input_log;
+struct chip8_stats;
+struct chip8_profile;
+struct chip8_capture;
+
+//How instructions are executed
+enum chip8_tier {
+    //Decodes every instruction with execute_instruction
+    CHIP8_TIER_INTERPRETER,
+    //Decodes each address once and dispatches through handler records
+    CHIP8_TIER_PREDECODE,
+    //Runs hot basic blocks as native x86-64 code, predecode elsewhere
+    CHIP8_TIER_JIT
+};
+
+//Settings applied to a machine by chip8_configure
+struct chip8_config {
+    enum chip8_tier tier;
+    //Instructions per 60 Hz frame, 0 for the default 700 Hz
+    unsigned cycles_per_frame;
+    //Frames run per 1/60 s on real time backends, 1 for normal speed
+    unsigned turbo;
+    //Run frames back to back on every backend and never wait for the display
+    bool unthrottled;
+    //Dxyn waits for the start of a frame on real time backends
+    bool display_wait;
+    //Seed for Cxkk, 0 seeds from the clock
+    uint64_t seed;
+};
+
+/*
+    Native code for one ROM, generated by chip8_aot and registered with chip8_register_native.
+    Machines that load a ROM with the same hash and size run it on every tier but the interpreter.
+*/
+struct chip8_native {
+    //FNV-1a hash of the ROM bytes, as in struct chip8_rom
+    uint64_t hash;
+    size_t size;
+    //Executes count instructions
+    void (*run)(struct chip8_vm* vm, uint64_t count);
+};
+
+//Recorders run_chip attaches to its machine for the whole session, each may be NULL
+struct chip8_session {
+    //Receives the keyboard changes
+    struct chip8_input_log* record;
+    //Receives execution counts on the interpreter tier
+    struct chip8_profile* profile;
+    //Receives every frame
+    struct chip8_capture* capture;
+};
+
+/*
+    State of one Chip8 machine. Every core function takes one of these so
+    any number of machines can run side by side, including on different threads.
+*/
+struct chip8_vm {
+    //Memory by page, each either a read only page shared with other machines or one in private_memory.
+    //Read with chip8_read, written with chip8_writable.
+    const uint8_t* pages[CHIP8_PAGES];
+    //Bit per page copied into private_memory
+    uint16_t private_pages;
+    //Offset into memory
+    uint16_t pc;
+
+    uint8_t registers[16];
+
+    uint16_t index_register;
+
+    uint8_t sound_timer;
+    uint8_t delay_timer;
+
+    //Stores offsets into memory
+    uint16_t stack[16];
+    uint8_t stack_ptr;
+
+    //Bitmap display, one word per row with x = 0 in the top bit
+    uint64_t display[CHIP8_HEIGHT];
+    //Bit per row changed since the backend last drew
+    uint32_t dirty_rows;
+    //Dxyn waits for the start of a frame, as on the COSMAC VIP
+    bool display_wait;
+    //Set at the start of each frame, cleared by the first sprite drawn while display_wait is on
+    bool vblank;
+
+    //Bit per key held down, key 0 in bit 0. Written by the backend, which may run on another thread.
+    _Atomic uint16_t keypad;
+    //Last key that was released, CHIP8_NO_KEY if none
+    uint8_t key_up;
+
+    //Cxkk generator state, never 0
+    uint64_t rng;
+
+    //Instructions executed and timer ticks
+    uint64_t cycles;
+    uint64_t frames;
+    //Instructions after which the machine stops, part way through a frame if need be. 0 for no limit.
+    uint64_t cycle_limit;
+
+    //Pacing, see struct chip8_config
+    unsigned cycles_per_frame;
+    unsigned turbo;
+    bool unthrottled;
+
+    enum chip8_tier tier;
+    //Decode cache for CHIP8_TIER_PREDECODE, one record per address
+    struct chip8_decoded* decoded;
+    //Translated blocks for CHIP8_TIER_JIT
+    struct chip8_jit* jit;
+    //Ahead of time compiled code of the loaded ROM, NULL if none is registered
+    const struct chip8_native* native;
+    //Bit per 64 byte page written since the ROM was loaded, native code falls back to the interpreter there
+    uint64_t native_dirty;
+    //Receives every keyboard change while not NULL, see replay.h
+    struct chip8_input_log* recording;
+    //Counts every instruction run by the interpreter tier while not NULL, see profile.h
+    struct chip8_profile* profile;
+    //Receives the framebuffer at the end of every frame while not NULL, see capture.h
+    struct chip8_capture* capture;
+#ifdef CHIP8_INSTRUMENT
+    //Hot path counters, see instrument.h
+    struct chip8_stats* stats;
+#endif
+
+    const struct backend* io;
+    //Per machine state owned by the backend
+    void* backend_data;
+
+    //Pages this machine has written, at their own addresses. Last so pages never written are never touched.
+    uint8_t private_memory[CHIP8_MEMORY_SIZE];
+};
+
+/*
+    Reads a byte of memory, address wraps at the end of memory
+*/
+static inline uint8_t chip8_read(const struct chip8_vm* vm, uint16_t address) {
+    address &= CHIP8_ADDRESS_MASK;
+    return vm->pages[address >> CHIP8_PAGE_SHIFT][address & (CHIP8_PAGE_SIZE - 1)];
+}
+
+/*
+    @returns The instruction at address
+*/
+static inline uint16_t chip8_instruction_at(const struct chip8_vm* vm, uint16_t address) {
+    return chip8_read(vm, address) << 8 | chip8_read(vm, address + 1);
+}
+
+/*
+    Reads pixel at (x, Top Left - y)
+*/
+static inline bool chip8_pixel(const struct chip8_vm* vm, int x, int y) {
+    return (vm->display[y] >> (63 - x)) & 1;
+}
+
+/*
+    Next byte of the machine's xorshift64* generator, so runs with the same seed are identical
+*/
+static inline uint8_t chip8_random(struct chip8_vm* vm) {
+    vm->rng ^= vm->rng >> 12;
+    vm->rng ^= vm->rng << 25;
+    vm->rng ^= vm->rng >> 27;
+    return (vm->rng * 0x2545F4914F6CDD1DULL) >> 56;
+}
+
+void chip8_init(struct chip8_vm* vm, const struct backend* backend);
+void chip8_release(struct chip8_vm* vm);
+bool chip8_set_tier(struct chip8_vm* vm, enum chip8_tier tier);
+void chip8_default_config(struct chip8_config* config);
+void chip8_configure(struct chip8_vm* vm, const struct chip8_config* config);
+void chip8_seed(struct chip8_vm* vm, uint64_t seed);
+bool chip8_register_native(const struct chip8_native* native);
+bool chip8_load(struct chip8_vm* vm, const char* filepath);
+bool chip8_load_rom(struct chip8_vm* vm, const uint8_t* rom, size_t size);
+bool chip8_make_image(uint8_t* image, const uint8_t* rom, size_t size);
+void chip8_load_image(struct chip8_vm* vm, const uint8_t* image);
+uint8_t* chip8_writable(struct chip8_vm* vm, uint16_t address);
+void chip8_copy_memory(const struct chip8_vm* vm, uint8_t* out);
+void chip8_memory_written(struct chip8_vm* vm, uint16_t address, uint16_t length);
+void execute_instruction(struct chip8_vm* vm, uint16_t instruction);
+void chip8_execute(struct chip8_vm* vm, uint64_t count);
+uint64_t chip8_skip_idle(struct chip8_vm* vm, uint64_t count);
+uint64_t chip8_frame_instructions(const struct chip8_vm* vm);
+uint64_t chip8_limit_instructions(const struct chip8_vm* vm, uint64_t count);
+void chip8_run_frame(struct chip8_vm* vm);
+void chip8_end_frame(struct chip8_vm* vm);
+void chip8_run(struct chip8_vm* vm);
+
+//Instruction semantics shared by every tier
+void chip8_clear_screen(struct chip8_vm* vm);
+bool chip8_draw_sprite(struct chip8_vm* vm, uint8_t vx, uint8_t vy, uint8_t length);
+bool chip8_key_down(struct chip8_vm* vm, uint8_t key);
+bool chip8_key_pressed(struct chip8_vm* vm, uint8_t* key);
+void chip8_store_bcd(struct chip8_vm* vm, uint8_t x);
+void chip8_store_registers(struct chip8_vm* vm, uint8_t x);
+void chip8_load_registers(struct chip8_vm* vm, uint8_t x);
+void run_chip(char* filepath, const struct backend* backend, const struct chip8_config* config, const struct chip8_session* session);
+
+#endif
@@ -0,0 +1,405 @@
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "chip8.h"
+#include "diffcheck.h"
+#include "disasm.h"
+#include "headless.h"
+#include "savestate.h"
+
+#define FNV_OFFSET 0xCBF29CE484222325ULL
+#define FNV_PRIME 0x100000001B3ULL
+
+//Keyboard a frame started with, applied to both machines
+struct frame_input {
+    uint16_t keypad;
+    uint8_t key_up;
+};
+
+//Everything compared between the machines
+struct digest {
+    uint8_t registers[16];
+    uint16_t index_register;
+    uint16_t pc;
+    uint16_t stack[16];
+    uint8_t stack_ptr;
+    uint8_t delay_timer;
+    uint8_t sound_timer;
+    //FNV-1a hashes
+    uint64_t memory;
+    uint64_t display;
+};
+
+/*
+    A machine on a fast tier and one on the interpreter run side by side on the same ROM,
+    seed and keyboard, compared every interval instructions. When they differ both go back
+    to the last comparison that matched and the first instruction that gives a different
+    state is found by bisection.
+*/
+struct chip8_diffcheck {
+    struct chip8_vm fast;
+    struct chip8_vm reference;
+    //Backend initialized on the fast machine
+    bool started;
+    uint64_t interval;
+    uint64_t checks;
+
+    //Both machines at the last comparison that matched
+    struct chip8_savestate fast_checkpoint;
+    struct chip8_savestate reference_checkpoint;
+    //Instructions the checkpoint's frame had left
+    uint64_t checkpoint_left;
+    //Instructions run since the checkpoint
+    uint64_t since_check;
+    //Keyboard of every frame started since the checkpoint
+    struct frame_input* inputs;
+    size_t num_inputs;
+    size_t inputs_capacity;
+
+    //Set once the machines differ, the machines are then left just after the instruction
+    bool diverged;
+    uint16_t address;
+    uint16_t instruction;
+    //Instructions run before the diverging one
+    uint64_t cycles;
+    uint64_t frames;
+};
+
+static uint64_t hash(const uint8_t* data, size_t size) {
+    uint64_t hash = FNV_OFFSET;
+    size_t i = 0;
+
+    for(;i < size;i++) {
+        hash = (hash ^ data[i]) * FNV_PRIME;
+    }
+
+    return hash;
+}
+
+static void digest(const struct chip8_vm* vm, struct digest* d) {
+    uint8_t memory[CHIP8_MEMORY_SIZE];
+
+    memcpy(d->registers, vm->registers, sizeof(d->registers));
+    memcpy(d->stack, vm->stack, sizeof(d->stack));
+    d->index_register = vm->index_register;
+    d->pc = vm->pc;
+    d->stack_ptr = vm->stack_ptr;
+    d->delay_timer = vm->delay_timer;
+    d->sound_timer = vm->sound_timer;
+    chip8_copy_memory(vm, memory);
+    d->memory = hash(memory, sizeof(memory));
+    d->display = hash((const uint8_t*) vm->display, sizeof(vm->display));
+}
+
+/*
+    @param out Receives a line per field that differs, may be NULL
+    @returns Number of fields that differ
+*/
+static int differences(const struct digest* reference, const struct digest* fast, FILE* out) {
+    int count = 0;
+    int i = 0;
+
+#define FIELD(name, reference_value, fast_value, format) \
+    if((reference_value) != (fast_value)) { \
+        count++; \
+        if(out) { \
+            fprintf(out, "  %-8s reference " format "  fast " format "\n", name, reference_value, fast_value); \
+        } \
+    }
+
+    for(;i < 16;i++) {
+        char name[8];
+        snprintf(name, sizeof(name), "V%X", i);
+        FIELD(name, reference->registers[i], fast->registers[i], "0x%02X");
+    }
+    FIELD("I", reference->index_register, fast->index_register, "0x%03X");
+    FIELD("PC", reference->pc, fast->pc, "0x%03X");
+    FIELD("SP", reference->stack_ptr, fast->stack_ptr, "%d");
+    for(i = 0;i < 16;i++) {
+        char name[12];
+        snprintf(name, sizeof(name), "stack[%d]", i);
+        FIELD(name, reference->stack[i], fast->stack[i], "0x%03X");
+    }
+    FIELD("DT", reference->delay_timer, fast->delay_timer, "%d");
+    FIELD("ST", reference->sound_timer, fast->sound_timer, "%d");
+    FIELD("memory", (unsigned long long) reference->memory, (unsigned long long) fast->memory, "%016llx");
+    FIELD("display", (unsigned long long) reference->display, (unsigned long long) fast->display, "%016llx");
+
+#undef FIELD
+    return count;
+}
+
+static bool matches(const struct chip8_diffcheck* dc) {
+    struct digest fast;
+    struct digest reference;
+
+    digest(&dc->fast, &fast);
+    digest(&dc->reference, &reference);
+    return !differences(&reference, &fast, NULL);
+}
+
+/*
+    Starts a frame on both machines with the same keyboard
+    @returns The number of instructions due in the frame
+*/
+static uint64_t begin_frame(struct chip8_diffcheck* dc, const struct frame_input* input) {
+    struct chip8_vm* vms[2] = {&dc->fast, &dc->reference};
+    int i = 0;
+
+    for(;i < 2;i++) {
+        atomic_store_explicit(&vms[i]->keypad, input->keypad, memory_order_relaxed);
+        vms[i]->key_up = input->key_up;
+        vms[i]->vblank = true;
+    }
+
+    return chip8_frame_instructions(&dc->fast);
+}
+
+static void run_both(struct chip8_diffcheck* dc, uint64_t count) {
+    chip8_execute(&dc->fast, count);
+    chip8_execute(&dc->reference, count);
+}
+
+static void end_frame(struct chip8_diffcheck* dc) {
+    chip8_end_frame(&dc->fast);
+    chip8_end_frame(&dc->reference);
+}
+
+/*
+    Puts both machines back at the checkpoint and runs count instructions split into frames
+    the way the checked run split them
+*/
+static void replay(struct chip8_diffcheck* dc, uint64_t count) {
+    uint64_t left = dc->checkpoint_left;
+    size_t frame = 0;
+
+    chip8_restore_state(&dc->fast, &dc->fast_checkpoint);
+    chip8_restore_state(&dc->reference, &dc->reference_checkpoint);
+
+    for(;;) {
+        uint64_t n = left < count ? left : count;
+
+        run_both(dc, n);
+        left -= n;
+        count -= n;
+        if(!count) {
+            break;
+        }
+
+        end_frame(dc);
+        left = begin_frame(dc, &dc->inputs[frame++]);
+    }
+}
+
+/*
+    Finds the first instruction since the checkpoint after which the machines differ. Bisection
+    assumes a difference lasts, one that goes away again before the comparison is not seen.
+*/
+static void locate(struct chip8_diffcheck* dc) {
+    uint64_t low = 1;
+    uint64_t high = dc->since_check;
+
+    while(low < high) {
+        uint64_t middle = low + (high - low) / 2;
+
+        replay(dc, middle);
+        if(matches(dc)) {
+            low = middle + 1;
+        }
+        else {
+            high = middle;
+        }
+    }
+
+    //The reference machine just before the instruction
+    replay(dc, low - 1);
+    dc->address = dc->reference.pc;
+    dc->instruction = chip8_instruction_at(&dc->reference, dc->address);
+    dc->cycles = dc->reference.cycles;
+    dc->frames = dc->reference.frames;
+
+    replay(dc, low);
+    dc->diverged = true;
+}
+
+/*
+    Compares the machines and moves the checkpoint up to them if they match
+    @param left Instructions the current frame has left
+    @returns False if they differ
+*/
+static bool check(struct chip8_diffcheck* dc, uint64_t left) {
+    dc->checks++;
+
+    if(!matches(dc)) {
+        locate(dc);
+        return false;
+    }
+
+    chip8_save_state(&dc->fast, &dc->fast_checkpoint);
+    chip8_save_state(&dc->reference, &dc->reference_checkpoint);
+    dc->checkpoint_left = left;
+    dc->since_check = 0;
+    dc->num_inputs = 0;
+    return true;
+}
+
+static bool push_input(struct chip8_diffcheck* dc, const struct frame_input* input) {
+    if(dc->num_inputs == dc->inputs_capacity) {
+        size_t capacity = dc->inputs_capacity ? dc->inputs_capacity * 2 : 64;
+        struct frame_input* inputs = realloc(dc->inputs, capacity * sizeof(*inputs));
+
+        if(!inputs) {
+            return false;
+        }
+        dc->inputs = inputs;
+        dc->inputs_capacity = capacity;
+    }
+
+    dc->inputs[dc->num_inputs++] = *input;
+    return true;
+}
+
+/*
+    @param config Settings of the fast machine, the reference runs the same settings on the interpreter
+    @param interval Instructions between comparisons, 0 compares after every instruction
+    @returns NULL if out of memory
+*/
+struct chip8_diffcheck* diffcheck_create(const struct chip8_config* config, uint64_t interval) {
+    struct chip8_diffcheck* dc = calloc(1, sizeof(*dc));
+    struct chip8_config reference = *config;
+
+    if(!dc) {
+        return NULL;
+    }
+
+    dc->interval = interval ? interval : 1;
+    reference.tier = CHIP8_TIER_INTERPRETER;
+
+    //Both run on the headless backend, which drives the fast machine's keyboard from its script
+    chip8_init(&dc->fast, &headless_backend);
+    chip8_configure(&dc->fast, config);
+    chip8_init(&dc->reference, &headless_backend);
+    chip8_configure(&dc->reference, &reference);
+    return dc;
+}
+
+void diffcheck_destroy(struct chip8_diffcheck* dc) {
+    if(!dc) {
+        return;
+    }
+
+    if(dc->started) {
+        dc->fast.io->close(&dc->fast);
+    }
+    chip8_release(&dc->fast);
+    chip8_release(&dc->reference);
+    free(dc->inputs);
+    free(dc);
+}
+
+/*
+    Loads the ROM into both machines, the reference starts from the fast machine's state so
+    they share the Cxkk seed
+    @returns False if the file could not be read or the backend could not start
+*/
+bool diffcheck_load(struct chip8_diffcheck* dc, const char* filepath) {
+    if(!chip8_load(&dc->fast, filepath) || !chip8_load(&dc->reference, filepath)) {
+        return false;
+    }
+
+    if(!dc->started && !(dc->started = dc->fast.io->initialize(&dc->fast))) {
+        return false;
+    }
+
+    chip8_save_state(&dc->fast, &dc->fast_checkpoint);
+    chip8_restore_state(&dc->reference, &dc->fast_checkpoint);
+    chip8_save_state(&dc->reference, &dc->reference_checkpoint);
+    dc->checkpoint_left = 0;
+    dc->since_check = 0;
+    dc->num_inputs = 0;
+    dc->diverged = false;
+    return true;
+}
+
+/*
+    Runs both machines until the backend stops or they differ
+    @returns False if they differ or out of memory, see diffcheck_report
+*/
+bool diffcheck_run(struct chip8_diffcheck* dc) {
+    while(!dc->diverged && dc->fast.io->handle_events(&dc->fast)) {
+        struct frame_input input = {atomic_load_explicit(&dc->fast.keypad, memory_order_relaxed), dc->fast.key_up};
+
+        if(!push_input(dc, &input)) {
+            return false;
+        }
+
+        uint64_t due = begin_frame(dc, &input);
+        uint64_t left = chip8_limit_instructions(&dc->fast, due);
+        //A frame cut short by the cycle limit stops before its timers
+        bool whole = left == due;
+
+        while(left) {
+            uint64_t n = dc->interval - dc->since_check;
+
+            if(n > left) {
+                n = left;
+            }
+
+            run_both(dc, n);
+            left -= n;
+            dc->since_check += n;
+            if(dc->since_check == dc->interval && !check(dc, left)) {
+                return false;
+            }
+        }
+
+        if(whole) {
+            end_frame(dc);
+        }
+    }
+
+    //Instructions since the last comparison
+    if(!dc->diverged && dc->since_check) {
+        //Unless the cycle limit cut it short, the last frame's timers already ticked and the replay stops just before that
+        return check(dc, 0);
+    }
+
+    return !dc->diverged;
+}
+
+/*
+    Prints the diverging instruction and every field that differs after it, or a summary if none did
+*/
+void diffcheck_report(const struct chip8_diffcheck* dc, FILE* out) {
+    if(!dc->diverged) {
+        fprintf(out, "No divergence in %llu instructions, %llu comparisons\n",
+            (unsigned long long) dc->fast.cycles, (unsigned long long) dc->checks);
+        return;
+    }
+
+    char text[32];
+    struct digest fast;
+    struct digest reference;
+
+    chip8_disassemble(dc->instruction, text, sizeof(text));
+    digest(&dc->fast, &fast);
+    digest(&dc->reference, &reference);
+
+    fprintf(out, "Diverged at instruction %llu, frame %llu\n", (unsigned long long) dc->cycles, (unsigned long long) dc->frames);
+    fprintf(out, "  0x%03X: %04X  %s\n", dc->address, dc->instruction, text);
+    differences(&reference, &fast, out);
+
+    //First differing byte when memory differs
+    int i = 0;
+    for(;i < CHIP8_MEMORY_SIZE;i++) {
+        if(chip8_read(&dc->fast, i) != chip8_read(&dc->reference, i)) {
+            fprintf(out, "  first memory difference at 0x%03X: reference 0x%02X  fast 0x%02X\n", i, chip8_read(&dc->reference, i), chip8_read(&dc->fast, i));
+            break;
+        }
+    }
+}
+
+#undef FNV_OFFSET
+#undef FNV_PRIME
@@ -0,0 +1,17 @@
+#ifndef DIFFCHECK_H
+#define DIFFCHECK_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+struct chip8_config;
+struct chip8_diffcheck;
+
+struct chip8_diffcheck* diffcheck_create(const struct chip8_config* config, uint64_t interval);
+void diffcheck_destroy(struct chip8_diffcheck* dc);
+bool diffcheck_load(struct chip8_diffcheck* dc, const char* filepath);
+bool diffcheck_run(struct chip8_diffcheck* dc);
+void diffcheck_report(const struct chip8_diffcheck* dc, FILE* out);
+
+#endif
@@ -0,0 +1,53 @@
+#include <stdio.h>
+
+#include "disasm.h"
+#include "predecode.h"
+
+/*
+    Writes the mnemonic of an instruction, decoded the same way every tier executes it
+    @param out Receives text such as "LD V3, 0x1F", always terminated
+    @returns Length of the text, as snprintf
+*/
+int chip8_disassemble(uint16_t instruction, char* out, size_t size) {
+    struct chip8_decoded d;
+
+    chip8_decode(instruction, &d);
+
+    switch(d.op) {
+        case OP_CLS: return snprintf(out, size, "CLS");
+        case OP_RET: return snprintf(out, size, "RET");
+        case OP_JP: return snprintf(out, size, "JP 0x%03X", d.nnn);
+        case OP_CALL: return snprintf(out, size, "CALL 0x%03X", d.nnn);
+        case OP_SE_IMM: return snprintf(out, size, "SE V%X, 0x%02X", d.x, d.kk);
+        case OP_SNE_IMM: return snprintf(out, size, "SNE V%X, 0x%02X", d.x, d.kk);
+        case OP_SE_REG: return snprintf(out, size, "SE V%X, V%X", d.x, d.y);
+        case OP_LD_IMM: return snprintf(out, size, "LD V%X, 0x%02X", d.x, d.kk);
+        case OP_ADD_IMM: return snprintf(out, size, "ADD V%X, 0x%02X", d.x, d.kk);
+        case OP_LD_REG: return snprintf(out, size, "LD V%X, V%X", d.x, d.y);
+        case OP_OR: return snprintf(out, size, "OR V%X, V%X", d.x, d.y);
+        case OP_AND: return snprintf(out, size, "AND V%X, V%X", d.x, d.y);
+        case OP_XOR: return snprintf(out, size, "XOR V%X, V%X", d.x, d.y);
+        case OP_ADD_REG: return snprintf(out, size, "ADD V%X, V%X", d.x, d.y);
+        case OP_SUB: return snprintf(out, size, "SUB V%X, V%X", d.x, d.y);
+        case OP_SHR: return snprintf(out, size, "SHR V%X", d.x);
+        case OP_SUBN: return snprintf(out, size, "SUBN V%X, V%X", d.x, d.y);
+        case OP_SHL: return snprintf(out, size, "SHL V%X", d.x);
+        case OP_SNE_REG: return snprintf(out, size, "SNE V%X, V%X", d.x, d.y);
+        case OP_LD_I: return snprintf(out, size, "LD I, 0x%03X", d.nnn);
+        case OP_JP_V0: return snprintf(out, size, "JP V0, 0x%03X", d.nnn);
+        case OP_RND: return snprintf(out, size, "RND V%X, 0x%02X", d.x, d.kk);
+        case OP_DRW: return snprintf(out, size, "DRW V%X, V%X, %d", d.x, d.y, d.n);
+        case OP_SKP: return snprintf(out, size, "SKP V%X", d.x);
+        case OP_SKNP: return snprintf(out, size, "SKNP V%X", d.x);
+        case OP_LD_VX_DT: return snprintf(out, size, "LD V%X, DT", d.x);
+        case OP_LD_KEY: return snprintf(out, size, "LD V%X, K", d.x);
+        case OP_LD_DT: return snprintf(out, size, "LD DT, V%X", d.x);
+        case OP_LD_ST: return snprintf(out, size, "LD ST, V%X", d.x);
+        case OP_ADD_I: return snprintf(out, size, "ADD I, V%X", d.x);
+        case OP_LD_FONT: return snprintf(out, size, "LD F, V%X", d.x);
+        case OP_BCD: return snprintf(out, size, "LD B, V%X", d.x);
+        case OP_STORE: return snprintf(out, size, "LD [I], V%X", d.x);
+        case OP_LOAD: return snprintf(out, size, "LD V%X, [I]", d.x);
+        default: return snprintf(out, size, "DW 0x%04X", instruction);
+    }
+}
@@ -0,0 +1,9 @@
+#ifndef DISASM_H
+#define DISASM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+int chip8_disassemble(uint16_t instruction, char* out, size_t size);
+
+#endif
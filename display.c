@@ -1,7 +1,9 @@
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdbool.h>
 #include <SDL2/SDL.h>
 #include <string.h>
+#include "chip8.h"
 #include "display.h"
 
 #define DEBUG 0 
@@ -10,32 +12,106 @@
 #define SCALE 10
 #define FPS 60
 #define NUM_KEYS 16
-#define NO_KEY 16
 #define TONE_HZ 430
 #define VOLUME 3000
+//About 10 ms at 48 kHz
+#define AUDIO_SAMPLES 512
+#define SOUND_RING 16
+//Frames the audio callback may fall behind the emulator before it skips ahead
+#define MAX_SOUND_LAG 2
 
+//One window per process, the framebuffer and keyboard belong to the machine being shown
 static SDL_Window *window;
 static SDL_Renderer *render;
-//Bitmap display
-static bool display[WIDTH][HEIGHT];
+//Streaming texture holding the display bitmap, only changed rows are uploaded
+static SDL_Texture *texture;
+static Uint32 pixels[HEIGHT][WIDTH];
 
-static Uint64 frame_start;
-
-//keyboard status up or down
-static bool keyboard[NUM_KEYS];
-//Last key that was triggered by key up event
-static uint8_t key_up = NO_KEY;
 static const char const keys[] = {'X','1','2','3','Q','W','E','A','S','D','Z','C','4','R','F','V'}; 
+//Keypad index of every scancode, -1 for keys that aren't mapped
+static int8_t scancode_keys[SDL_NUM_SCANCODES];
+
+/*
+    Sound timer state of each frame. Single producer, the emulation thread, and single consumer,
+    the audio callback. Neither side ever waits for the other.
+*/
+static struct {
+    bool on[SOUND_RING];
+    //Frames written, only changed by the producer
+    atomic_uint head;
+    //Frames read, only changed by the consumer
+    atomic_uint tail;
+} sound;
+
+//Audio callback state: square wave phase as a fraction of 2^32 and position in the current frame
+static uint32_t phase;
+static uint32_t phase_step;
+static int samples_per_frame;
+static int frame_samples_left;
+static bool tone_on;
+static int empty_frames;
+
+/*
+    Fills the device buffer with a square wave of TONE_HZ and amplitude VOLUME while the sound timer runs.
+    The phase carries over between frames and buffers, so the tone has no clicks.
+*/
+static void audio_callback(void* userdata, Uint8* stream, int len) {
+    int16_t* out = (int16_t*) stream;
+    int count = len / sizeof(int16_t);
+    int i = 0;
+
+    for(;i < count;i++) {
+        if(!frame_samples_left) {
+            unsigned head = atomic_load_explicit(&sound.head, memory_order_acquire);
+            unsigned tail = atomic_load_explicit(&sound.tail, memory_order_relaxed);
+
+            //Turbo and unthrottled runs produce frames faster than they are played
+            if(head - tail > MAX_SOUND_LAG) {
+                tail = head - MAX_SOUND_LAG;
+            }
+
+            if(head != tail) {
+                tone_on = sound.on[tail % SOUND_RING];
+                atomic_store_explicit(&sound.tail, tail + 1, memory_order_release);
+                empty_frames = 0;
+            }
+            //A late frame keeps the last state for a frame, a stopped emulator goes quiet
+            else if(++empty_frames > 1) {
+                tone_on = false;
+            }
+
+            frame_samples_left = samples_per_frame;
+        }
+
+        frame_samples_left--;
+        out[i] = tone_on ? (phase < 0x80000000u ? VOLUME : -VOLUME) : 0;
+        phase += phase_step;
+    }
+}
+
+/*
+    Fills scancode_keys from keys[], so events are mapped with one table lookup
+*/
+static void build_scancode_table(void) {
+    char name[2] = {0};
+    int i = 0;
+
+    memset(scancode_keys, -1, sizeof(scancode_keys));
+    for(;i < NUM_KEYS;i++) {
+        name[0] = keys[i];
+        SDL_Scancode s = SDL_GetScancodeFromName(name);
 
-//Square wave with a period of TONE_HZ and amplitude VOLUME
-static void* beep_buffer;
-static Uint32 beep_buffer_byte_len;
+        if(s > 0 && s < SDL_NUM_SCANCODES) {
+            scancode_keys[s] = i;
+        }
+    }
+}
 
 /*
     Setup audio and display
     @returns zero for failure and 1 for success in initialization
 */
-bool initialize_display(void) {
+static bool initialize_display(struct chip8_vm* vm) {
 
     if(SDL_Init(SDL_INIT_VIDEO | SDL_INIT_AUDIO) < 0) {
         if(DEBUG) {
@@ -45,7 +121,7 @@ bool initialize_display(void) {
     }
 
     window = SDL_CreateWindow("CHIP-8", SDL_WINDOWPOS_CENTERED,SDL_WINDOWPOS_CENTERED,WIDTH * SCALE,HEIGHT * SCALE,SDL_WINDOW_BORDERLESS);
-    render = SDL_CreateRenderer(window, -1, SDL_RENDERER_ACCELERATED | SDL_RENDERER_PRESENTVSYNC);
+    render = SDL_CreateRenderer(window, -1, SDL_RENDERER_ACCELERATED);
 
     if(!window) {
         if(DEBUG) {
@@ -65,14 +141,27 @@ bool initialize_display(void) {
 
     SDL_SetRenderDrawColor(render, 0, 0, 0, 0);
 
+    texture = SDL_CreateTexture(render, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STREAMING, WIDTH, HEIGHT);
+    if(!texture) {
+        if(DEBUG) {
+            printf("%s", "Texture not initialized");
+        }
+        return false;
+    }
+
+    build_scancode_table();
+
+    //Every row is uploaded on the first draw
+    vm->dirty_rows = ~(uint32_t) 0;
+
     SDL_AudioSpec wanted_spec;
     SDL_zero(wanted_spec);
 
     wanted_spec.freq = 48000;
     wanted_spec.format = AUDIO_S16LSB;
     wanted_spec.channels = 1;
-    wanted_spec.samples = 4096; 
-    wanted_spec.callback = NULL;
+    wanted_spec.samples = AUDIO_SAMPLES;
+    wanted_spec.callback = audio_callback;
 
     SDL_AudioSpec gotten_spec;
     if(SDL_OpenAudio(&wanted_spec, &gotten_spec)) {
@@ -89,29 +178,27 @@ bool initialize_display(void) {
         return false;
     }
 
-    beep_buffer_byte_len = sizeof(int16_t) * (gotten_spec.freq / FPS);
-    beep_buffer = malloc(beep_buffer_byte_len);
-
-    int16_t* it = (int16_t*) beep_buffer;
-    int i = 0;
-    //Initializes beep buffer with square wave
-    for(;i < (gotten_spec.freq / FPS);i++) {
-        *it++ = ((i / (gotten_spec.freq / TONE_HZ / 2)) % 2) ? VOLUME : -VOLUME;
-    }
+    phase = 0;
+    phase_step = (uint32_t) (((uint64_t) TONE_HZ << 32) / gotten_spec.freq);
+    samples_per_frame = gotten_spec.freq / FPS;
+    frame_samples_left = 0;
+    tone_on = false;
+    empty_frames = 0;
+    atomic_store(&sound.head, 0);
+    atomic_store(&sound.tail, 0);
 
     SDL_PauseAudio(0);
 
     SDL_RenderPresent(render);
 
-    frame_start = SDL_GetPerformanceCounter();
-
     return true;
 }
 
 /*
     Closes all system resources
 */
-void close_display(void) {
+static void close_display(struct chip8_vm* vm) {
+    SDL_DestroyTexture(texture);
     SDL_DestroyRenderer(render);
     SDL_CloseAudio();
     SDL_DestroyWindow(window);
@@ -119,83 +206,42 @@ void close_display(void) {
 }
 
 /*
-    Redraws entire screen using the display bitmap
+    Uploads the rows of the display bitmap that changed since the last frame and presents once.
+    Nothing is presented if no row changed.
 */
-void draw(void) { 
-    SDL_RenderClear(render);
+static void draw(struct chip8_vm* vm) { 
+    uint32_t dirty = vm->dirty_rows;
 
-    int y = 0;
-    for(;y < HEIGHT; y++) {
-        int x = 0;
-        for(;x < WIDTH; x++) {
-            if(display[x][y]) {
-                //Draw white pixel
-                SDL_SetRenderDrawColor(render, 255, 255, 255, 255);
-            }
-            else {
-                //Draw black pixel
-                SDL_SetRenderDrawColor(render, 0, 0, 0, 0);
-            }
-
-            SDL_RenderDrawPoint(render, x, y);
-        }
+    if(!dirty) {
+        return;
     }
 
-    SDL_RenderPresent(render);
-}
+    int first = __builtin_ctz(dirty);
+    int last = 31 - __builtin_clz(dirty);
 
-/*
-    Clears display bitmap and screen    
-*/
-void clear_screen(void) { 
-    SDL_RenderClear(render);
-    SDL_SetRenderDrawColor(render, 0, 0, 0, 0);
+    int y = first;
+    for(;y <= last; y++) {
+        if(!(dirty & (1u << y))) {
+            continue;
+        }
 
-    int y = 0;
-    for(;y < HEIGHT; y++) {
+        uint64_t row = vm->display[y];
         int x = 0;
         for(;x < WIDTH; x++) {
-            display[x][y] = 0;
+            //White or black pixel
+            pixels[y][x] = (row >> (63 - x)) & 1 ? 0xFFFFFFFF : 0xFF000000;
         }
     }
 
-    SDL_RenderPresent(render);
-}
-
-/*
-    Toggles pixel at (x, Top Left - y)
-    @returns previous state of pixel
-*/
-bool toggle_pixel(int x, int y) {
-    return !(display[x][y] = !display[x][y]);
-}
+    //One upload covering every changed row
+    SDL_Rect rect = {0, first, WIDTH, last - first + 1};
+    SDL_UpdateTexture(texture, &rect, pixels[first], sizeof(pixels[0]));
 
-/*
-    Gets status of key (pressed or depressed). Status updated by handle_events().
-    @param key Hexadecimal of key to get status of
-    @returns true if key is pressed down and otherwise false
-*/
-bool key_down(uint8_t key) {
-    return keyboard[key];
-}
-
-/*
-    Checks if any key was depressed. Status updated by handle_events().
-    @param key Sets key to the latest key(hexadecimal) that was depressed
-    @returns True if any key was depressed
-*/
-bool key_pressed(uint8_t* key) {
-    if(key_up != NO_KEY) {
-        if(key) {
-            *key = key_up;
-        }
+    vm->dirty_rows = 0;
 
-        key_up = NO_KEY;
-        return true;
-    }
-    
-    return false;
-    
+    SDL_RenderClear(render);
+    SDL_RenderCopy(render, texture, NULL, NULL);
+    SDL_RenderPresent(render);
 }
 
 /*
@@ -204,44 +250,31 @@ bool key_pressed(uint8_t* key) {
     @returns Hexadecimal converted from s. Returns -1 if key not defined
 */
 static int scancode_to_index(SDL_Scancode s) {
-    const char* key = SDL_GetScancodeName(s);
-
-    if(strlen(key) != 1) {
-        return -1;
-    }
-
-    int i = 0;
-    for(;i < NUM_KEYS;i++) {
-        if(*key == keys[i]) {
-            return i;
-        }
-    }
-
-    return -1;
+    return s >= 0 && s < SDL_NUM_SCANCODES ? scancode_keys[s] : -1;
 }
 
 /*
-    Handles all events related to GUI including closing window and handling key presses
+    Handles all events related to GUI including closing window and handling key presses.
+    Every pending event is applied and the keypad is published once.
+    @returns False if the window was closed
 */
-void handle_events(void){
+static bool handle_events(struct chip8_vm* vm){
     SDL_Event event;
+    uint16_t keypad = atomic_load_explicit(&vm->keypad, memory_order_relaxed);
 
-    key_up = NO_KEY;
+    vm->key_up = CHIP8_NO_KEY;
     while(SDL_PollEvent(&event)) {
         if(event.type == SDL_QUIT) {
-            close_display();
-            exit(0);
+            return false;
         }
 
         else if(event.type == SDL_KEYDOWN) {
             int key_index = scancode_to_index(event.key.keysym.scancode);
-            
-            
+
             if(key_index != -1) {
                 //updates key to be pressed
-                keyboard[key_index] = true;
+                keypad |= 1 << key_index;
             }
-            break;
         }
 
         else if(event.type == SDL_KEYUP) {
@@ -249,44 +282,47 @@ void handle_events(void){
             
             if(key_index != -1) {
                 //updates key to be depressed
-                keyboard[key_index] = false;
-                key_up = key_index;
+                keypad &= ~(1 << key_index);
+                vm->key_up = key_index;
             }
-            break;
         }
     }
+
+    atomic_store_explicit(&vm->keypad, keypad, memory_order_relaxed);
+    return true;
 }
 
 /*
-    Checks if 1/60 of a second past
-    @returns True if 1/60 of a second past
+    Passes this frame's sound state to the audio callback. A full ring drops the frame instead of waiting.
 */
-bool frame_drawn(void) {
-    Uint64 frame_end = SDL_GetPerformanceCounter();
+static void set_sound(struct chip8_vm* vm, bool on) {
+    unsigned head = atomic_load_explicit(&sound.head, memory_order_relaxed);
+    unsigned tail = atomic_load_explicit(&sound.tail, memory_order_acquire);
 
-    float time_dif = (frame_end - frame_start) / (float) SDL_GetPerformanceFrequency() * 1000.0f;
-
-    if(time_dif > 1.0 / FPS) {
-        frame_start = SDL_GetPerformanceCounter();
-        return true;
+    if(head - tail < SOUND_RING) {
+        sound.on[head % SOUND_RING] = on;
+        atomic_store_explicit(&sound.head, head + 1, memory_order_release);
     }
-
-    return false;
 }
 
-/*
-    Plays beep_buffer sound
-*/
-void play_beep(void) {
-    SDL_QueueAudio(1, beep_buffer, beep_buffer_byte_len);
-}
+const struct backend sdl_backend = {
+    .name = "sdl",
+    .realtime = true,
+    .initialize = initialize_display,
+    .close = close_display,
+    .draw = draw,
+    .handle_events = handle_events,
+    .set_sound = set_sound
+};
 
 #undef WIDTH  
 #undef HEIGHT 
 #undef SCALE
 #undef FPS
 #undef NUM_KEYS
-#undef NO_KEY
 #undef TONE_HZ
 #undef VOLUME
+#undef AUDIO_SAMPLES
+#undef SOUND_RING
+#undef MAX_SOUND_LAG
 #undef DEBUG
\ No newline at end of file
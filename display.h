@@ -1,17 +1,9 @@
 #ifndef DISPLAY_H
 #define DISPLAY_H
 
-#include <stdbool.h>
+#include "backend.h"
 
-bool initialize_display(void);
-void close_display(void);
-void clear_screen(void);
-void draw(void);
-bool toggle_pixel(int x, int y);
-bool key_down(uint8_t key);
-bool key_pressed(uint8_t* key);
-void handle_events(void);
-bool frame_drawn(void);
-void play_beep(void);
+//SDL2 window, keyboard and audio backend
+extern const struct backend sdl_backend;
 
 #endif
\ No newline at end of file
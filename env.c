@@ -0,0 +1,151 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "chip8.h"
+#include "env.h"
+#include "lockstep.h"
+#include "savestate.h"
+
+/*
+    A batch of headless machines running one ROM, driven a few frames at a time by a caller
+    such as a search or training loop. The lanes run in lockstep so a whole batch costs one call.
+*/
+struct chip8_env {
+    struct chip8_lockstep* ls;
+    //Power on state every reset returns to, the lanes only differ in their generator
+    struct chip8_savestate initial;
+    //Cxkk generator of each lane at power on
+    uint64_t* rngs;
+};
+
+/*
+    @returns True if the lane is stuck on a jump to itself, the usual way a CHIP-8 program ends
+*/
+static bool halted(const struct chip8_vm* vm) {
+    uint16_t instruction = chip8_instruction_at(vm, vm->pc);
+
+    return (instruction >> 12) == 0x1 && (instruction & 0xFFF) == vm->pc;
+}
+
+/*
+    @param rom Path to the ROM every lane runs
+    @param lanes Number of machines
+    @param seed Cxkk seed of lane 0, lane i gets seed + i. 0 seeds every lane from the clock.
+    @param cycles_per_frame Instructions per frame, 0 for 700 Hz
+    @returns NULL if the ROM could not be loaded or out of memory
+*/
+CHIP8_API struct chip8_env* chip8_env_create(const char* rom, int lanes, uint64_t seed, int cycles_per_frame) {
+    struct chip8_env* env = calloc(1, sizeof(*env));
+    struct chip8_config config;
+
+    if(!env) {
+        return NULL;
+    }
+
+    chip8_default_config(&config);
+    config.unthrottled = true;
+    config.cycles_per_frame = cycles_per_frame;
+    config.seed = seed;
+
+    if(!(env->ls = lockstep_create(lanes, &config)) || !lockstep_load(env->ls, rom) ||
+        !(env->rngs = malloc(sizeof(*env->rngs) * lockstep_lanes(env->ls)))) {
+        chip8_env_destroy(env);
+        return NULL;
+    }
+
+    chip8_save_state(lockstep_lane(env->ls, 0), &env->initial);
+
+    int i = 0;
+    for(;i < lockstep_lanes(env->ls);i++) {
+        env->rngs[i] = lockstep_lane(env->ls, i)->rng;
+    }
+    return env;
+}
+
+CHIP8_API void chip8_env_destroy(struct chip8_env* env) {
+    if(env) {
+        lockstep_destroy(env->ls);
+        free(env->rngs);
+        free(env);
+    }
+}
+
+CHIP8_API int chip8_env_lanes(const struct chip8_env* env) {
+    return lockstep_lanes(env->ls);
+}
+
+/*
+    Returns lanes to the state right after the ROM was loaded
+    @param lanes Byte per lane, nonzero to reset it. NULL resets every lane.
+    @param seeds New Cxkk seed per lane, NULL for the seed the lane was created with
+*/
+CHIP8_API void chip8_env_reset(struct chip8_env* env, const uint8_t* lanes, const uint64_t* seeds) {
+    int count = lockstep_lanes(env->ls);
+    int i = 0;
+
+    for(;i < count;i++) {
+        if(lanes && !lanes[i]) {
+            continue;
+        }
+
+        struct chip8_vm* vm = lockstep_lane(env->ls, i);
+        //Lanes keep their frame count so every lane keeps running the same number of instructions per frame
+        uint64_t cycles = vm->cycles;
+        uint64_t frames = vm->frames;
+
+        chip8_restore_state(vm, &env->initial);
+        vm->cycles = cycles;
+        vm->frames = frames;
+
+        if(seeds) {
+            chip8_seed(vm, seeds[i]);
+        }
+        else {
+            vm->rng = env->rngs[i];
+        }
+    }
+}
+
+/*
+    Applies one keypad per lane and runs frames on every lane
+    @param keypads Bit per key held down for each lane, held for all the frames
+    @param frames Number of 60 Hz frames to run
+    @param framebuffers Receives CHIP8_ENV_ROWS words per lane after the last frame, may be NULL
+    @param terminal Receives a byte per lane, 1 if the lane has halted, may be NULL
+*/
+CHIP8_API void chip8_env_step(struct chip8_env* env, const uint16_t* keypads, int frames, uint64_t* framebuffers, uint8_t* terminal) {
+    int count = lockstep_lanes(env->ls);
+    int i;
+    int f = 0;
+
+    for(;f < frames;f++) {
+        //Releases are only reported to Fx0A in the first frame
+        for(i = 0;i < count;i++) {
+            lockstep_set_keypad(env->ls, i, keypads[i]);
+        }
+        lockstep_run_frame(env->ls);
+    }
+
+    chip8_env_observe(env, framebuffers, terminal);
+}
+
+/*
+    Reads every lane without running it
+    @param framebuffers Receives CHIP8_ENV_ROWS words per lane, may be NULL
+    @param terminal Receives a byte per lane, 1 if the lane has halted, may be NULL
+*/
+CHIP8_API void chip8_env_observe(struct chip8_env* env, uint64_t* framebuffers, uint8_t* terminal) {
+    int count = lockstep_lanes(env->ls);
+    int i = 0;
+
+    for(;i < count;i++) {
+        struct chip8_vm* vm = lockstep_lane(env->ls, i);
+
+        if(framebuffers) {
+            memcpy(framebuffers + (size_t) i * CHIP8_ENV_ROWS, vm->display, sizeof(vm->display));
+        }
+        if(terminal) {
+            terminal[i] = halted(vm);
+        }
+    }
+}
@@ -0,0 +1,21 @@
+#ifndef ENV_H
+#define ENV_H
+
+#include <stdint.h>
+
+//Symbols exported from the shared library, build it with -fvisibility=hidden to keep the rest private
+#define CHIP8_API __attribute__((visibility("default")))
+
+//Rows of one packed framebuffer, row y pixel x is bit 63 - x of word y
+#define CHIP8_ENV_ROWS 32
+
+struct chip8_env;
+
+CHIP8_API struct chip8_env* chip8_env_create(const char* rom, int lanes, uint64_t seed, int cycles_per_frame);
+CHIP8_API void chip8_env_destroy(struct chip8_env* env);
+CHIP8_API int chip8_env_lanes(const struct chip8_env* env);
+CHIP8_API void chip8_env_reset(struct chip8_env* env, const uint8_t* lanes, const uint64_t* seeds);
+CHIP8_API void chip8_env_step(struct chip8_env* env, const uint16_t* keypads, int frames, uint64_t* framebuffers, uint8_t* terminal);
+CHIP8_API void chip8_env_observe(struct chip8_env* env, uint64_t* framebuffers, uint8_t* terminal);
+
+#endif
@@ -0,0 +1,181 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "chip8.h"
+#include "headless.h"
+
+#define DEBUG 0
+#define QUIT_KEY -1
+
+//Key change read from the input script
+struct script_event {
+    uint64_t cycle;
+    //Hexadecimal key or QUIT_KEY
+    int key;
+    bool down;
+};
+
+//Per machine position in the script
+struct headless_state {
+    size_t script_pos;
+};
+
+//Script and limits are shared by every machine and only written before they start
+static struct script_event* script;
+static size_t script_len;
+
+//Zero for no limit
+static uint64_t cycle_limit;
+//Where to print the framebuffer when a machine stops, NULL for nowhere
+static FILE* print_out;
+
+/*
+    Loads a key script. Each line is "<cycle> <hex key> <down|up>" or "<cycle> quit",
+    sorted by cycle. Lines starting with '#' are ignored.
+    @param filepath The filepath for the script
+    @returns False if the script could not be read
+*/
+bool headless_load_script(const char* filepath) {
+    FILE* file;
+
+    if(!(file = fopen(filepath, "r"))) {
+        if(DEBUG) {
+            printf("Couldn't open script %s\n", filepath);
+        }
+        return false;
+    }
+
+    size_t capacity = 0;
+    char line[128];
+    while(fgets(line, sizeof(line), file)) {
+        unsigned long long at;
+        unsigned hex;
+        char action[16];
+        int key = QUIT_KEY;
+        bool down = false;
+
+        if(line[0] == '#' || sscanf(line, "%llu %15s", &at, action) != 2) {
+            continue;
+        }
+
+        if(strcmp(action, "quit")) {
+            if(sscanf(line, "%llu %x %15s", &at, &hex, action) != 3 || hex >= CHIP8_NUM_KEYS || (strcmp(action, "down") && strcmp(action, "up"))) {
+                if(DEBUG) {
+                    printf("Bad script line: %s", line);
+                }
+                continue;
+            }
+
+            key = hex;
+            down = !strcmp(action, "down");
+        }
+
+        if(script_len == capacity) {
+            capacity = capacity ? capacity * 2 : 64;
+            script = realloc(script, capacity * sizeof(*script));
+        }
+
+        script[script_len++] = (struct script_event) {at, key, down};
+    }
+
+    fclose(file);
+    return true;
+}
+
+/*
+    Stops the emulator after a fixed number of instructions
+    @param cycles Number of instructions to run, zero for no limit
+*/
+void headless_set_cycle_limit(uint64_t cycles) {
+    cycle_limit = cycles;
+}
+
+/*
+    Prints the framebuffer of every machine that stops
+    @param out Stream to print to, NULL to stop printing
+*/
+void headless_set_print(FILE* out) {
+    print_out = out;
+}
+
+/*
+    Prints the framebuffer as text, '#' for a set pixel
+*/
+void headless_print(struct chip8_vm* vm, FILE* out) {
+    int y = 0;
+    for(;y < CHIP8_HEIGHT; y++) {
+        int x = 0;
+        for(;x < CHIP8_WIDTH; x++) {
+            fputc(chip8_pixel(vm, x, y) ? '#' : '.', out);
+        }
+        fputc('\n', out);
+    }
+}
+
+static bool initialize(struct chip8_vm* vm) {
+    //The core stops the last frame on the limit
+    vm->cycle_limit = cycle_limit;
+    vm->backend_data = calloc(1, sizeof(struct headless_state));
+    return vm->backend_data != NULL;
+}
+
+static void close_headless(struct chip8_vm* vm) {
+    if(print_out) {
+        headless_print(vm, print_out);
+    }
+
+    free(vm->backend_data);
+    vm->backend_data = NULL;
+}
+
+//Nothing to present, the framebuffer is only kept in memory
+static void draw(struct chip8_vm* vm) {
+    vm->dirty_rows = 0;
+}
+
+/*
+    Applies the script events that are due by the number of executed instructions.
+    The core calls this once per frame, so events land on the next frame after their cycle.
+    @returns False once the script quits or the cycle limit is reached
+*/
+static bool handle_events(struct chip8_vm* vm) {
+    struct headless_state* state = vm->backend_data;
+
+    vm->key_up = CHIP8_NO_KEY;
+    for(;state->script_pos < script_len && script[state->script_pos].cycle <= vm->cycles;state->script_pos++) {
+        struct script_event* e = &script[state->script_pos];
+
+        if(e->key == QUIT_KEY) {
+            return false;
+        }
+
+        if(e->down) {
+            atomic_fetch_or_explicit(&vm->keypad, 1 << e->key, memory_order_relaxed);
+        }
+        else {
+            atomic_fetch_and_explicit(&vm->keypad, ~(1 << e->key), memory_order_relaxed);
+            vm->key_up = e->key;
+        }
+    }
+
+    return !vm->cycle_limit || vm->cycles < vm->cycle_limit;
+}
+
+//No audio device, the sound timer still counts down in the core
+static void set_sound(struct chip8_vm* vm, bool on) {
+    (void) vm;
+    (void) on;
+}
+
+const struct backend headless_backend = {
+    .name = "headless",
+    .realtime = false,
+    .initialize = initialize,
+    .close = close_headless,
+    .draw = draw,
+    .handle_events = handle_events,
+    .set_sound = set_sound
+};
+
+#undef DEBUG
+#undef QUIT_KEY
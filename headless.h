@@ -0,0 +1,18 @@
+#ifndef HEADLESS_H
+#define HEADLESS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "backend.h"
+
+//Backend without window, vsync or audio device. Framebuffer is kept in memory.
+extern const struct backend headless_backend;
+
+bool headless_load_script(const char* filepath);
+void headless_set_cycle_limit(uint64_t cycles);
+void headless_set_print(FILE* out);
+void headless_print(struct chip8_vm* vm, FILE* out);
+
+#endif
@@ -0,0 +1,168 @@
+#ifdef CHIP8_INSTRUMENT
+
+#define _POSIX_C_SOURCE 200809L
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "chip8.h"
+#include "instrument.h"
+
+#define DEBUG 0
+#define DEFAULT_INTERVAL 60
+#define MAX_PATH 4096
+
+//Where the exported machine's counters go, set before machines are created
+static const char* snapshot_path = NULL;
+static unsigned snapshot_interval = DEFAULT_INTERVAL;
+static const char* shared_name = NULL;
+
+//Only the first machine attached exports, the others still count for themselves
+static _Atomic(struct chip8_stats*) exported = NULL;
+static struct chip8_stats* shared = NULL;
+
+/*
+    Writes the exported machine's counters to filepath every interval_frames frames and when it is released
+    @returns False if the interval is 0
+*/
+bool instrument_set_snapshot(const char* filepath, unsigned interval_frames) {
+    if(!interval_frames) {
+        return false;
+    }
+
+    snapshot_path = filepath;
+    snapshot_interval = interval_frames;
+    return true;
+}
+
+/*
+    Keeps the exported machine's counters in the POSIX shared memory object name, updated live
+    @param name Object name such as "/chip8_stats", left in place after exit for readers
+    @returns False if the region couldn't be created
+*/
+bool instrument_set_shared(const char* name) {
+    int fd = shm_open(name, O_CREAT | O_RDWR, 0644);
+
+    if(fd < 0) {
+        return false;
+    }
+
+    if(ftruncate(fd, sizeof(struct chip8_stats))) {
+        close(fd);
+        return false;
+    }
+
+    shared = mmap(NULL, sizeof(struct chip8_stats), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if(shared == MAP_FAILED) {
+        shared = NULL;
+        return false;
+    }
+
+    shared_name = name;
+    return true;
+}
+
+/*
+    Gives the machine zeroed counters, called by chip8_init
+*/
+void instrument_attach(struct chip8_vm* vm) {
+    struct chip8_stats* expected = NULL;
+    struct chip8_stats* stats = shared;
+
+    //The shared region can only belong to one machine at a time
+    if(!stats || !atomic_compare_exchange_strong(&exported, &expected, stats)) {
+        stats = malloc(sizeof(*stats));
+        expected = NULL;
+        if(stats && !shared) {
+            atomic_compare_exchange_strong(&exported, &expected, stats);
+        }
+    }
+
+    if(stats) {
+        memset(stats, 0, sizeof(*stats));
+        stats->magic = CHIP8_STATS_MAGIC;
+        stats->version = CHIP8_STATS_VERSION;
+    }
+    else if(DEBUG) {
+        printf("Counters not allocated\n");
+    }
+
+    vm->stats = stats;
+}
+
+static void snapshot(struct chip8_stats* stats) {
+    stats->sequence++;
+
+    if(snapshot_path && !instrument_write(stats, snapshot_path) && DEBUG) {
+        printf("Couldn't write counters to %s\n", snapshot_path);
+    }
+}
+
+/*
+    Takes the final snapshot and frees the counters, called by chip8_release
+*/
+void instrument_detach(struct chip8_vm* vm) {
+    struct chip8_stats* stats = vm->stats;
+    struct chip8_stats* expected = stats;
+
+    if(!stats) {
+        return;
+    }
+
+    if(atomic_compare_exchange_strong(&exported, &expected, NULL)) {
+        snapshot(stats);
+    }
+
+    if(stats != shared) {
+        free(stats);
+    }
+    vm->stats = NULL;
+}
+
+/*
+    Counts a frame and takes the periodic snapshot, called at the end of every frame
+*/
+void instrument_frame(struct chip8_vm* vm) {
+    struct chip8_stats* stats = vm->stats;
+
+    if(stats && ++stats->frames % snapshot_interval == 0 && stats == atomic_load_explicit(&exported, memory_order_relaxed)) {
+        snapshot(stats);
+    }
+}
+
+/*
+    Writes counters to a new file that replaces filepath in one step, so readers never see half a snapshot
+    @returns False if the file couldn't be written
+*/
+bool instrument_write(const struct chip8_stats* stats, const char* filepath) {
+    char temp[MAX_PATH];
+
+    if(snprintf(temp, sizeof(temp), "%s.tmp", filepath) >= (int) sizeof(temp)) {
+        return false;
+    }
+
+    FILE* file = fopen(temp, "wb");
+    if(!file) {
+        return false;
+    }
+
+    bool ok = fwrite(stats, sizeof(*stats), 1, file) == 1;
+    if(fclose(file) || !ok || rename(temp, filepath)) {
+        remove(temp);
+        return false;
+    }
+
+    return true;
+}
+
+#undef DEBUG
+#undef DEFAULT_INTERVAL
+#undef MAX_PATH
+
+#endif
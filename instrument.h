@@ -0,0 +1,93 @@
+#ifndef INSTRUMENT_H
+#define INSTRUMENT_H
+
+/*
+    Counters for the hot paths, built only with -DCHIP8_INSTRUMENT.
+    Without it every CHIP8_INSTRUMENT_* hook expands to nothing and the
+    machine carries no extra fields.
+*/
+
+#ifdef CHIP8_INSTRUMENT
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "chip8.h"
+#include "predecode.h"
+
+//"C8PR" read as a little endian word
+#define CHIP8_STATS_MAGIC 0x52503843
+#define CHIP8_STATS_VERSION 1
+
+/*
+    Counters of one machine. This is also the layout of snapshot files and of the shared memory region,
+    words are in host byte order.
+*/
+struct chip8_stats {
+    uint32_t magic;
+    uint32_t version;
+    //Bumped after every snapshot so readers of shared memory can tell updates apart
+    uint64_t sequence;
+
+    uint64_t instructions;
+    uint64_t frames;
+    //Indexed by enum chip8_op, OP_DECODE stays 0
+    uint64_t op_counts[NUM_OPS];
+    //Instructions fetched from each address
+    uint64_t pc_heat[CHIP8_MEMORY_SIZE];
+
+    //Dxyn that drew, rows drawn and draws that set VF
+    uint64_t sprites;
+    uint64_t sprite_rows;
+    uint64_t collisions;
+    //Dxyn that waited for the next frame because of the display wait
+    uint64_t display_wait_stalls;
+};
+
+bool instrument_set_snapshot(const char* filepath, unsigned interval_frames);
+bool instrument_set_shared(const char* name);
+void instrument_attach(struct chip8_vm* vm);
+void instrument_detach(struct chip8_vm* vm);
+void instrument_frame(struct chip8_vm* vm);
+bool instrument_write(const struct chip8_stats* stats, const char* filepath);
+
+static inline void instrument_instruction(struct chip8_vm* vm, uint16_t address) {
+    struct chip8_stats* stats = vm->stats;
+    struct chip8_decoded d;
+
+    if(stats) {
+        chip8_decode(chip8_instruction_at(vm, address), &d);
+        stats->instructions++;
+        stats->op_counts[d.op]++;
+        stats->pc_heat[address]++;
+    }
+}
+
+static inline void instrument_sprite(struct chip8_vm* vm, unsigned rows, bool collision) {
+    if(vm->stats) {
+        vm->stats->sprites++;
+        vm->stats->sprite_rows += rows;
+        vm->stats->collisions += collision;
+    }
+}
+
+static inline void instrument_stall(struct chip8_vm* vm) {
+    if(vm->stats) {
+        vm->stats->display_wait_stalls++;
+    }
+}
+
+#define CHIP8_INSTRUMENT_INSTRUCTION(vm, address) instrument_instruction(vm, address)
+#define CHIP8_INSTRUMENT_SPRITE(vm, rows, collision) instrument_sprite(vm, rows, collision)
+#define CHIP8_INSTRUMENT_STALL(vm) instrument_stall(vm)
+#define CHIP8_INSTRUMENT_FRAME(vm) instrument_frame(vm)
+
+#else
+
+#define CHIP8_INSTRUMENT_INSTRUCTION(vm, address) ((void) 0)
+#define CHIP8_INSTRUMENT_SPRITE(vm, rows, collision) ((void) 0)
+#define CHIP8_INSTRUMENT_STALL(vm) ((void) 0)
+#define CHIP8_INSTRUMENT_FRAME(vm) ((void) 0)
+
+#endif
+
+#endif
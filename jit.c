@@ -0,0 +1,770 @@
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "chip8.h"
+#include "jit.h"
+#include "predecode.h"
+
+#if defined(__x86_64__) && (defined(__linux__) || defined(__APPLE__))
+#define JIT_SUPPORTED 1
+#include <sys/mman.h>
+#else
+#define JIT_SUPPORTED 0
+#endif
+
+#define DEBUG 0
+//Size of the executable buffer, flushed completely when full
+#define CODE_SIZE (256 * 1024)
+//Worst case code for one block must fit before a block is started
+#define MAX_BLOCK_CODE 4096
+#define MAX_BLOCK_LENGTH 64
+//Executions of an address in the interpreter before its block is compiled
+#define HOT_THRESHOLD 8
+//Granularity of code invalidation
+#define PAGE_SHIFT 6
+//Host registers available to hold Chip8 registers
+#define NUM_HOST_REGISTERS 11
+#define NO_HOST_REGISTER 0xFF
+//Outside memory, so no exit ever matches it
+#define NO_IDLE_PC 0xFFFF
+
+//x86-64 register numbers
+#define RAX 0
+#define RCX 1
+#define RDX 2
+#define RBX 3
+#define RBP 5
+#define RSI 6
+#define RDI 7
+#define R8 8
+#define R12 12
+
+typedef void (*block_fn)(struct chip8_vm* vm);
+
+//Translated run of instructions starting at one address
+struct jit_block {
+    block_fn code;
+    //Instructions executed by one call, the same on every exit
+    uint16_t length;
+    //Program counter the block leaves when it may be waiting for the next frame, NO_IDLE_PC if it never is
+    uint16_t idle_pc;
+};
+
+struct chip8_jit {
+    uint8_t* code;
+    size_t code_used;
+
+    struct jit_block blocks[CHIP8_MEMORY_SIZE];
+    //Interpreted executions per address, 255 once compiled or found untranslatable
+    uint8_t hits[CHIP8_MEMORY_SIZE];
+    //Bit per page of Chip8 memory that translated code was read from
+    uint64_t code_pages;
+};
+
+/*
+    Checks if this build can generate native code
+*/
+bool jit_supported(void) {
+    return JIT_SUPPORTED;
+}
+
+#if JIT_SUPPORTED
+
+//Emitter state for one block
+struct emitter {
+    uint8_t* p;
+    //Host register holding each Chip8 register, NO_HOST_REGISTER if unused by the block
+    uint8_t host[16];
+    //Chip8 registers written by the block
+    uint16_t dirty;
+    //Callee saved host registers used by the block
+    uint8_t saved[NUM_HOST_REGISTERS];
+    int num_saved;
+};
+
+//Host registers in allocation order, caller saved first
+static const uint8_t host_registers[NUM_HOST_REGISTERS] = {RSI, R8, R8 + 1, R8 + 2, R8 + 3, RBX, RBP, R12, R12 + 1, R12 + 2, R12 + 3};
+
+#define OFF_REGISTERS ((int32_t) offsetof(struct chip8_vm, registers))
+#define OFF_PC ((int32_t) offsetof(struct chip8_vm, pc))
+#define OFF_INDEX ((int32_t) offsetof(struct chip8_vm, index_register))
+#define OFF_DELAY ((int32_t) offsetof(struct chip8_vm, delay_timer))
+#define OFF_SOUND ((int32_t) offsetof(struct chip8_vm, sound_timer))
+#define OFF_STACK ((int32_t) offsetof(struct chip8_vm, stack))
+#define OFF_STACK_PTR ((int32_t) offsetof(struct chip8_vm, stack_ptr))
+
+static void emit8(struct emitter* e, uint8_t b) {
+    *e->p++ = b;
+}
+
+static void emit32(struct emitter* e, uint32_t v) {
+    memcpy(e->p, &v, 4);
+    e->p += 4;
+}
+
+static void emit16(struct emitter* e, uint16_t v) {
+    memcpy(e->p, &v, 2);
+    e->p += 2;
+}
+
+//REX prefix only when an extended register is used
+static void rex(struct emitter* e, int reg, int rm) {
+    if(reg >= 8 || rm >= 8) {
+        emit8(e, 0x40 | ((reg >= 8) << 2) | (rm >= 8));
+    }
+}
+
+//[rdi + disp32] operand
+static void mem_rdi(struct emitter* e, int reg, int32_t disp) {
+    emit8(e, 0x80 | ((reg & 7) << 3) | RDI);
+    emit32(e, disp);
+}
+
+//op r/m32, r32 with both operands registers
+static void alu_rr(struct emitter* e, uint8_t opcode, int dst, int src) {
+    rex(e, src, dst);
+    emit8(e, opcode);
+    emit8(e, 0xC0 | ((src & 7) << 3) | (dst & 7));
+}
+
+//op r/m32, imm32 (81 /ext)
+static void alu_ri(struct emitter* e, int ext, int dst, uint32_t imm) {
+    rex(e, 0, dst);
+    emit8(e, 0x81);
+    emit8(e, 0xC0 | (ext << 3) | (dst & 7));
+    emit32(e, imm);
+}
+
+//shift r32, imm8 (C1 /ext)
+static void shift_ri(struct emitter* e, int ext, int dst, uint8_t imm) {
+    rex(e, 0, dst);
+    emit8(e, 0xC1);
+    emit8(e, 0xC0 | (ext << 3) | (dst & 7));
+    emit8(e, imm);
+}
+
+static void mov_ri(struct emitter* e, int dst, uint32_t imm) {
+    rex(e, 0, dst);
+    emit8(e, 0xB8 + (dst & 7));
+    emit32(e, imm);
+}
+
+static void mov_rr(struct emitter* e, int dst, int src) {
+    if(dst != src) {
+        alu_rr(e, 0x89, dst, src);
+    }
+}
+
+//movzx r32, byte [rdi + disp]
+static void load_byte(struct emitter* e, int dst, int32_t disp) {
+    rex(e, dst, 0);
+    emit8(e, 0x0F);
+    emit8(e, 0xB6);
+    mem_rdi(e, dst, disp);
+}
+
+//mov byte [rdi + disp], r8. Always has a REX prefix so registers 4-7 mean spl-dil
+static void store_byte(struct emitter* e, int32_t disp, int src) {
+    emit8(e, 0x40 | ((src >= 8) << 2));
+    emit8(e, 0x88);
+    mem_rdi(e, src, disp);
+}
+
+//movzx r32, word [rdi + disp]
+static void load_word(struct emitter* e, int dst, int32_t disp) {
+    rex(e, dst, 0);
+    emit8(e, 0x0F);
+    emit8(e, 0xB7);
+    mem_rdi(e, dst, disp);
+}
+
+//mov word [rdi + disp], r16
+static void store_word(struct emitter* e, int32_t disp, int src) {
+    emit8(e, 0x66);
+    rex(e, src, 0);
+    emit8(e, 0x89);
+    mem_rdi(e, src, disp);
+}
+
+//mov word [rdi + disp], imm16
+static void store_word_imm(struct emitter* e, int32_t disp, uint16_t imm) {
+    emit8(e, 0x66);
+    emit8(e, 0xC7);
+    mem_rdi(e, 0, disp);
+    emit16(e, imm);
+}
+
+//eax = vm->stack_ptr & 0xF
+static void load_stack_slot(struct emitter* e) {
+    load_byte(e, RAX, OFF_STACK_PTR);
+    alu_ri(e, 4, RAX, 0xF);
+}
+
+/*
+    Host register for Chip8 register v, the block loads it on entry
+*/
+static int reg(struct emitter* e, int v) {
+    return e->host[v];
+}
+
+static int reg_write(struct emitter* e, int v) {
+    e->dirty |= 1 << v;
+    return e->host[v];
+}
+
+/*
+    Writes back dirty registers and restores callee saved ones
+*/
+static void emit_restore(struct emitter* e) {
+    int v = 0;
+    for(;v < 16;v++) {
+        if(e->dirty & (1 << v)) {
+            store_byte(e, OFF_REGISTERS + v, e->host[v]);
+        }
+    }
+
+    int i = e->num_saved - 1;
+    for(;i >= 0;i--) {
+        rex(e, 0, e->saved[i]);
+        emit8(e, 0x58 + (e->saved[i] & 7));
+    }
+}
+
+static void emit_exit(struct emitter* e) {
+    emit_restore(e);
+    emit8(e, 0xC3);
+}
+
+static void emit_exit_to(struct emitter* e, uint16_t pc) {
+    store_word_imm(e, OFF_PC, pc & CHIP8_ADDRESS_MASK);
+    emit_exit(e);
+}
+
+/*
+    Leaves the block by tail calling execute_instruction, which returns straight to jit_run
+    @param instruction Instruction to execute
+    @param next Address after the instruction, execute_instruction expects pc past it
+*/
+static void emit_exit_interpret(struct emitter* e, uint16_t instruction, uint16_t next) {
+    store_word_imm(e, OFF_PC, next);
+    emit_restore(e);
+    mov_ri(e, RSI, instruction);
+    //mov rax, imm64; jmp rax
+    emit8(e, 0x48);
+    emit8(e, 0xB8);
+    uint64_t target = (uint64_t) (uintptr_t) execute_instruction;
+    memcpy(e->p, &target, 8);
+    e->p += 8;
+    emit8(e, 0xFF);
+    emit8(e, 0xE0);
+}
+
+/*
+    Skip instruction: exits to pc + 4 if the last compare sets the condition, otherwise to pc + 2
+    @param skip_if_equal True for 3xkk/5xy0, false for 4xkk/9xy0
+    @param next Address after the skip instruction
+*/
+static void emit_skip(struct emitter* e, bool skip_if_equal, uint16_t next) {
+    emit8(e, 0x0F);
+    emit8(e, skip_if_equal ? 0x85 : 0x84);
+    uint8_t* patch = e->p;
+    emit32(e, 0);
+
+    emit_exit_to(e, next + 2);
+
+    int32_t rel = (int32_t) (e->p - (patch + 4));
+    memcpy(patch, &rel, 4);
+    emit_exit_to(e, next);
+}
+
+/*
+    Checks if an instruction is translated and whether it ends the block
+    @returns 0 if not translated, 1 if translated, 2 if translated and ends the block,
+    3 if it ends the block by running through the interpreter
+*/
+static int classify(struct chip8_decoded* d) {
+    switch(d->op) {
+        case OP_LD_IMM: case OP_ADD_IMM: case OP_LD_REG: case OP_OR: case OP_AND: case OP_XOR:
+        case OP_ADD_REG: case OP_SUB: case OP_SHR: case OP_SUBN: case OP_SHL: case OP_LD_I:
+        case OP_LD_VX_DT: case OP_LD_DT: case OP_LD_ST: case OP_ADD_I: case OP_LD_FONT:
+            return 1;
+        case OP_JP: case OP_CALL: case OP_RET: case OP_JP_V0:
+        case OP_SE_IMM: case OP_SNE_IMM: case OP_SE_REG: case OP_SNE_REG:
+            return 2;
+        //Display, keypad, memory and random ops share the interpreter's code
+        case OP_CLS: case OP_RND: case OP_DRW: case OP_SKP: case OP_SKNP:
+        case OP_LD_KEY: case OP_BCD: case OP_STORE: case OP_LOAD:
+            return 3;
+        default:
+            return 0;
+    }
+}
+
+//Chip8 registers read or written by an instruction
+static uint16_t registers_used(struct chip8_decoded* d) {
+    switch(d->op) {
+        case OP_LD_IMM: case OP_ADD_IMM: case OP_LD_VX_DT: case OP_LD_DT: case OP_LD_ST:
+        case OP_LD_FONT: case OP_SE_IMM: case OP_SNE_IMM:
+            return 1 << d->x;
+        case OP_LD_REG: case OP_SE_REG: case OP_SNE_REG:
+            return 1 << d->x | 1 << d->y;
+        case OP_OR: case OP_AND: case OP_XOR: case OP_ADD_REG: case OP_SUB:
+        case OP_SHR: case OP_SUBN: case OP_SHL:
+            return 1 << d->x | 1 << d->y | 1 << 15;
+        case OP_ADD_I:
+            return 1 << d->x | 1 << 15;
+        case OP_JP_V0:
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+static int count_bits(uint16_t v) {
+    int n = 0;
+    for(;v;v &= v - 1) {
+        n++;
+    }
+    return n;
+}
+
+static uint16_t read_instruction(struct chip8_vm* vm, uint16_t address) {
+    return chip8_instruction_at(vm, address);
+}
+
+/*
+    Translates one instruction that does not end the block
+*/
+static void emit_instruction(struct emitter* e, struct chip8_decoded* d) {
+    switch(d->op) {
+        case OP_LD_IMM:
+            mov_ri(e, reg_write(e, d->x), d->kk);
+            break;
+
+        case OP_ADD_IMM:
+            alu_ri(e, 0, reg_write(e, d->x), d->kk);
+            alu_ri(e, 4, reg(e, d->x), 0xFF);
+            break;
+
+        case OP_LD_REG:
+            mov_rr(e, reg_write(e, d->x), reg(e, d->y));
+            break;
+
+        //OR, AND and XOR reset VF
+        case OP_OR:
+        case OP_AND:
+        case OP_XOR:
+            alu_rr(e, d->op == OP_OR ? 0x09 : d->op == OP_AND ? 0x21 : 0x31, reg_write(e, d->x), reg(e, d->y));
+            mov_ri(e, reg_write(e, 15), 0);
+            break;
+
+        case OP_ADD_REG:
+            mov_rr(e, RAX, reg(e, d->x));
+            alu_rr(e, 0x01, RAX, reg(e, d->y));
+            mov_rr(e, RDX, RAX);
+            shift_ri(e, 5, RDX, 8);
+            alu_ri(e, 4, RAX, 0xFF);
+            mov_rr(e, reg_write(e, d->x), RAX);
+            mov_rr(e, reg_write(e, 15), RDX);
+            break;
+
+        //VF is 1 when there is no borrow
+        case OP_SUB:
+        case OP_SUBN:
+            mov_rr(e, RAX, reg(e, d->op == OP_SUB ? d->x : d->y));
+            alu_rr(e, 0x29, RAX, reg(e, d->op == OP_SUB ? d->y : d->x));
+            mov_rr(e, RDX, RAX);
+            shift_ri(e, 5, RDX, 31);
+            alu_ri(e, 6, RDX, 1);
+            alu_ri(e, 4, RAX, 0xFF);
+            mov_rr(e, reg_write(e, d->x), RAX);
+            mov_rr(e, reg_write(e, 15), RDX);
+            break;
+
+        case OP_SHR:
+            mov_rr(e, RAX, reg(e, d->y));
+            mov_rr(e, RDX, RAX);
+            alu_ri(e, 4, RDX, 1);
+            shift_ri(e, 5, RAX, 1);
+            mov_rr(e, reg_write(e, d->x), RAX);
+            mov_rr(e, reg_write(e, 15), RDX);
+            break;
+
+        case OP_SHL:
+            mov_rr(e, RAX, reg(e, d->y));
+            mov_rr(e, RDX, RAX);
+            shift_ri(e, 5, RDX, 7);
+            shift_ri(e, 4, RAX, 1);
+            alu_ri(e, 4, RAX, 0xFF);
+            mov_rr(e, reg_write(e, d->x), RAX);
+            mov_rr(e, reg_write(e, 15), RDX);
+            break;
+
+        case OP_LD_I:
+            store_word_imm(e, OFF_INDEX, d->nnn);
+            break;
+
+        case OP_LD_VX_DT:
+            load_byte(e, reg_write(e, d->x), OFF_DELAY);
+            break;
+
+        case OP_LD_DT:
+        case OP_LD_ST:
+            store_byte(e, d->op == OP_LD_DT ? OFF_DELAY : OFF_SOUND, reg(e, d->x));
+            break;
+
+        //VF is set if the 16 bit index register ends above 0xFFF
+        case OP_ADD_I:
+            load_word(e, RAX, OFF_INDEX);
+            alu_rr(e, 0x01, RAX, reg(e, d->x));
+            //movzx eax, ax
+            emit8(e, 0x0F);
+            emit8(e, 0xB7);
+            emit8(e, 0xC0);
+            store_word(e, OFF_INDEX, RAX);
+            alu_rr(e, 0x31, RDX, RDX);
+            alu_ri(e, 7, RAX, 0xFFF);
+            //seta dl
+            emit8(e, 0x0F);
+            emit8(e, 0x97);
+            emit8(e, 0xC2);
+            mov_rr(e, reg_write(e, 15), RDX);
+            break;
+
+        case OP_LD_FONT:
+            mov_rr(e, RAX, reg(e, d->x));
+            //imul eax, eax, 5
+            emit8(e, 0x6B);
+            emit8(e, 0xC0);
+            emit8(e, 5);
+            store_word(e, OFF_INDEX, RAX);
+            break;
+    }
+}
+
+/*
+    Translates one instruction that ends the block, every path stores pc and returns
+    @param next Address after the instruction
+*/
+static void emit_terminator(struct emitter* e, struct chip8_decoded* d, uint16_t next) {
+    switch(d->op) {
+        case OP_JP:
+            emit_exit_to(e, d->nnn);
+            break;
+
+        case OP_CALL:
+            //mov word [rdi + rax * 2 + stack], next
+            load_stack_slot(e);
+            emit8(e, 0x66);
+            emit8(e, 0xC7);
+            emit8(e, 0x84);
+            emit8(e, 0x47);
+            emit32(e, OFF_STACK);
+            emit16(e, next);
+            //inc byte [rdi + stack_ptr]
+            emit8(e, 0xFE);
+            mem_rdi(e, 0, OFF_STACK_PTR);
+            emit_exit_to(e, d->nnn);
+            break;
+
+        case OP_RET:
+            //dec byte [rdi + stack_ptr]
+            emit8(e, 0xFE);
+            mem_rdi(e, 1, OFF_STACK_PTR);
+            load_stack_slot(e);
+            //movzx eax, word [rdi + rax * 2 + stack]
+            emit8(e, 0x0F);
+            emit8(e, 0xB7);
+            emit8(e, 0x84);
+            emit8(e, 0x47);
+            emit32(e, OFF_STACK);
+            store_word(e, OFF_PC, RAX);
+            emit_exit(e);
+            break;
+
+        case OP_JP_V0:
+            mov_rr(e, RAX, reg(e, 0));
+            alu_ri(e, 0, RAX, d->nnn);
+            alu_ri(e, 4, RAX, CHIP8_ADDRESS_MASK);
+            store_word(e, OFF_PC, RAX);
+            emit_exit(e);
+            break;
+
+        case OP_SE_IMM:
+        case OP_SNE_IMM:
+            alu_ri(e, 7, reg(e, d->x), d->kk);
+            emit_skip(e, d->op == OP_SE_IMM, next);
+            break;
+
+        case OP_SE_REG:
+        case OP_SNE_REG:
+            alu_rr(e, 0x39, reg(e, d->x), reg(e, d->y));
+            emit_skip(e, d->op == OP_SE_REG, next);
+            break;
+    }
+}
+
+/*
+    Flushes all translated code
+*/
+static void flush(struct chip8_jit* jit) {
+    memset(jit->blocks, 0, sizeof(jit->blocks));
+    memset(jit->hits, 0, sizeof(jit->hits));
+    jit->code_used = 0;
+    jit->code_pages = 0;
+}
+
+static void mark_pages(struct chip8_jit* jit, uint16_t start, uint16_t end) {
+    uint16_t page = start >> PAGE_SHIFT;
+
+    if(end > CHIP8_ADDRESS_MASK) {
+        end = CHIP8_ADDRESS_MASK;
+    }
+    for(;page <= (end >> PAGE_SHIFT);page++) {
+        jit->code_pages |= 1ULL << page;
+    }
+}
+
+/*
+    Translates the basic block starting at start
+    @returns The block or NULL if its first instruction can't be translated
+*/
+static struct jit_block* compile(struct chip8_vm* vm, uint16_t start) {
+    struct chip8_jit* jit = vm->jit;
+    struct chip8_decoded decoded[MAX_BLOCK_LENGTH];
+    struct emitter e;
+    uint16_t used = 0;
+    uint16_t address = start;
+    int length = 0;
+    int terminator = 0;
+
+    //Find the end of the block and the registers it uses
+    while(length < MAX_BLOCK_LENGTH && address <= CHIP8_ADDRESS_MASK - 1) {
+        struct chip8_decoded* d = &decoded[length];
+        chip8_decode(read_instruction(vm, address), d);
+
+        int kind = classify(d);
+        if(!kind || count_bits(used | registers_used(d)) > NUM_HOST_REGISTERS) {
+            break;
+        }
+
+        used |= registers_used(d);
+        address += 2;
+        length++;
+
+        if(kind >= 2) {
+            terminator = kind;
+            break;
+        }
+    }
+
+    mark_pages(jit, start, address + 1);
+    jit->hits[start] = 0xFF;
+
+    if(!length) {
+        return NULL;
+    }
+
+    if(CODE_SIZE - jit->code_used < MAX_BLOCK_CODE) {
+        flush(jit);
+        mark_pages(jit, start, address + 1);
+        jit->hits[start] = 0xFF;
+    }
+
+    if(mprotect(jit->code, CODE_SIZE, PROT_READ | PROT_WRITE)) {
+        return NULL;
+    }
+
+    memset(&e, 0, sizeof(e));
+    memset(e.host, NO_HOST_REGISTER, sizeof(e.host));
+    e.p = jit->code + jit->code_used;
+    uint8_t* entry = e.p;
+
+    //Prologue: save callee saved registers and load every register the block uses
+    int next_host = 0;
+    int v = 0;
+    for(;v < 16;v++) {
+        if(used & (1 << v)) {
+            int host = host_registers[next_host++];
+            e.host[v] = host;
+
+            if(host == RBX || host == RBP || host >= R12) {
+                e.saved[e.num_saved++] = host;
+                rex(&e, 0, host);
+                emit8(&e, 0x50 + (host & 7));
+            }
+
+            load_byte(&e, host, OFF_REGISTERS + v);
+        }
+    }
+
+    int i = 0;
+    for(;i < length;i++) {
+        uint16_t next = (start + 2 * (i + 1)) & CHIP8_ADDRESS_MASK;
+
+        if(terminator == 3 && i == length - 1) {
+            emit_exit_interpret(&e, read_instruction(vm, address - 2), next);
+        }
+        else if(terminator && i == length - 1) {
+            emit_terminator(&e, &decoded[i], next);
+        }
+        else {
+            emit_instruction(&e, &decoded[i]);
+        }
+    }
+
+    if(!terminator) {
+        emit_exit_to(&e, address);
+    }
+
+    jit->code_used += e.p - entry;
+    mprotect(jit->code, CODE_SIZE, PROT_READ | PROT_EXEC);
+
+    if(DEBUG) {
+        printf("jit: block %03x, %d instructions, %d bytes\n", start, length, (int) (e.p - entry));
+    }
+
+    struct jit_block* block = &jit->blocks[start];
+    struct chip8_decoded* last = &decoded[length - 1];
+    uint16_t last_address = (start + 2 * (length - 1)) & CHIP8_ADDRESS_MASK;
+
+    block->code = (block_fn) entry;
+    block->length = length;
+    block->idle_pc = NO_IDLE_PC;
+    //A jump to itself or back to an Fx07 3xkk 1nnn loop, or Fx0A and Dxyn stalled in place,
+    //the only exits chip8_skip_idle can skip after
+    if(last->op == OP_JP && (last->nnn == last_address || last->nnn == ((last_address - 4) & CHIP8_ADDRESS_MASK))) {
+        block->idle_pc = last->nnn;
+    }
+    else if(last->op == OP_LD_KEY || last->op == OP_DRW) {
+        block->idle_pc = last_address;
+    }
+    return block;
+}
+
+/*
+    Allocates an empty translation cache
+    @returns NULL if native code is not supported or out of memory
+*/
+struct chip8_jit* jit_create(void) {
+    struct chip8_jit* jit = calloc(1, sizeof(*jit));
+
+    if(!jit) {
+        return NULL;
+    }
+
+    jit->code = mmap(NULL, CODE_SIZE, PROT_READ | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(jit->code == MAP_FAILED) {
+        free(jit);
+        return NULL;
+    }
+
+    return jit;
+}
+
+void jit_destroy(struct chip8_jit* jit) {
+    if(jit) {
+        munmap(jit->code, CODE_SIZE);
+        free(jit);
+    }
+}
+
+/*
+    Drops all translated code if the written bytes overlap a page code was translated from
+*/
+void jit_invalidate(struct chip8_jit* jit, uint16_t address, uint16_t length) {
+    uint32_t end = (uint32_t) address + length;
+    uint32_t page = address >> PAGE_SHIFT;
+
+    //Writes past the end of memory wrap to the start
+    if(end > CHIP8_MEMORY_SIZE) {
+        jit_invalidate(jit, 0, end - CHIP8_MEMORY_SIZE);
+        end = CHIP8_MEMORY_SIZE;
+    }
+
+    for(;page <= ((end - 1) >> PAGE_SHIFT);page++) {
+        if(jit->code_pages & (1ULL << page)) {
+            flush(jit);
+            return;
+        }
+    }
+}
+
+/*
+    Executes instructions, running translated blocks where they exist and interpreting
+    through the decode cache elsewhere. Blocks are only entered if they fit in count.
+    @param count Number of instructions to execute
+*/
+void jit_run(struct chip8_vm* vm, uint64_t count) {
+    struct chip8_jit* jit = vm->jit;
+
+    while(count) {
+        uint16_t pc = vm->pc;
+        struct jit_block* block = &jit->blocks[pc];
+
+        if(!block->code && jit->hits[pc] < HOT_THRESHOLD && ++jit->hits[pc] == HOT_THRESHOLD) {
+            block = compile(vm, pc);
+        }
+
+        if(block && block->code && block->length <= count) {
+            //Memory writes at the end of the block may flush it
+            uint16_t length = block->length;
+            uint16_t idle_pc = block->idle_pc;
+
+            block->code(vm);
+            vm->cycles += length;
+            count -= length;
+
+            if(vm->pc == idle_pc) {
+                uint64_t spent = chip8_skip_idle(vm, count);
+
+                vm->cycles += spent;
+                count -= spent;
+            }
+        }
+        else {
+            predecode_run(vm, 1);
+            count--;
+        }
+    }
+}
+
+#else
+
+struct chip8_jit* jit_create(void) {
+    return NULL;
+}
+
+void jit_destroy(struct chip8_jit* jit) {
+}
+
+void jit_invalidate(struct chip8_jit* jit, uint16_t address, uint16_t length) {
+}
+
+void jit_run(struct chip8_vm* vm, uint64_t count) {
+    predecode_run(vm, count);
+}
+
+#endif
+
+#undef JIT_SUPPORTED
+#undef DEBUG
+#undef CODE_SIZE
+#undef MAX_BLOCK_CODE
+#undef MAX_BLOCK_LENGTH
+#undef HOT_THRESHOLD
+#undef PAGE_SHIFT
+#undef NUM_HOST_REGISTERS
+#undef NO_HOST_REGISTER
+#undef NO_IDLE_PC
+#undef RAX
+#undef RCX
+#undef RDX
+#undef RBX
+#undef RBP
+#undef RSI
+#undef RDI
+#undef R8
+#undef R12
@@ -0,0 +1,16 @@
+#ifndef JIT_H
+#define JIT_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+struct chip8_vm;
+struct chip8_jit;
+
+bool jit_supported(void);
+struct chip8_jit* jit_create(void);
+void jit_destroy(struct chip8_jit* jit);
+void jit_invalidate(struct chip8_jit* jit, uint16_t address, uint16_t length);
+void jit_run(struct chip8_vm* vm, uint64_t count);
+
+#endif
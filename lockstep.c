@@ -0,0 +1,557 @@
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+#include "chip8.h"
+#include "headless.h"
+#include "lockstep.h"
+
+//Lanes are stored in whole vectors, the lanes past the last one are computed and never read
+#define VECTOR_LANES 32
+#define NIBBLE(n) ((instruction >> (16 - n * 4)) & 0xF)
+//Register x of every lane
+#define REGISTER(ls, x) ((ls)->v + (size_t) (x) * (ls)->stride)
+
+/*
+    Machines stepped together one instruction at a time. The registers, program counter, index
+    and timers are kept as one array per field with an entry per lane, so when every lane is
+    about to run the same instruction the ALU opcodes update all lanes with vector instructions.
+    Lanes that diverge, and opcodes that touch memory, the display or the stack, run one lane at
+    a time on the lane's own chip8_vm, which always holds its memory, display, stack and keypad.
+*/
+struct chip8_lockstep {
+    int lanes;
+    //Lanes rounded up to whole vectors
+    int stride;
+
+    //v[x * stride + lane]
+    uint8_t* v;
+    uint16_t* pc;
+    uint16_t* index_register;
+    uint8_t* delay_timer;
+    uint8_t* sound_timer;
+
+    struct chip8_vm* vms;
+    //Lanes whose registers were handed out by lockstep_lane and must be read back
+    bool* lent;
+    //Lanes initialized with the backend
+    int started;
+
+    //Steps run on all lanes at once and steps run one lane at a time
+    uint64_t uniform;
+    uint64_t divergent;
+};
+
+/*
+    Copies a lane's registers into its machine
+*/
+static void lane_to_vm(struct chip8_lockstep* ls, int lane) {
+    struct chip8_vm* vm = &ls->vms[lane];
+    int x = 0;
+
+    for(;x < 16;x++) {
+        vm->registers[x] = REGISTER(ls, x)[lane];
+    }
+    vm->pc = ls->pc[lane];
+    vm->index_register = ls->index_register[lane];
+    vm->delay_timer = ls->delay_timer[lane];
+    vm->sound_timer = ls->sound_timer[lane];
+}
+
+/*
+    Copies a machine's registers into its lane
+*/
+static void vm_to_lane(struct chip8_lockstep* ls, int lane) {
+    const struct chip8_vm* vm = &ls->vms[lane];
+    int x = 0;
+
+    for(;x < 16;x++) {
+        REGISTER(ls, x)[lane] = vm->registers[x];
+    }
+    ls->pc[lane] = vm->pc;
+    ls->index_register[lane] = vm->index_register;
+    ls->delay_timer[lane] = vm->delay_timer;
+    ls->sound_timer[lane] = vm->sound_timer;
+}
+
+/*
+    Runs one instruction on one lane with the interpreter
+    @param instruction Instruction already fetched, the lane's pc points past it
+*/
+static void execute_lane(struct chip8_lockstep* ls, int lane, uint16_t instruction) {
+    lane_to_vm(ls, lane);
+    execute_instruction(&ls->vms[lane], instruction);
+    vm_to_lane(ls, lane);
+}
+
+/*
+    8xyN on one lane, same results as execute_instruction
+    @param vf Receives the flag, left alone by 8xy0
+    @returns The new value of vx
+*/
+static inline uint8_t alu_scalar(int op, uint8_t a, uint8_t b, uint8_t* vf) {
+    switch(op) {
+        case 0x1: *vf = 0; return a | b;
+        case 0x2: *vf = 0; return a & b;
+        case 0x3: *vf = 0; return a ^ b;
+        case 0x4: *vf = a + b > 0xFF; return a + b;
+        case 0x5: *vf = a >= b; return a - b;
+        case 0x6: *vf = b & 1; return b >> 1;
+        case 0x7: *vf = b >= a; return b - a;
+        case 0xE: *vf = b >> 7; return b << 1;
+        default: return b;
+    }
+}
+
+#ifdef __AVX2__
+/*
+    8xyN on 32 lanes, alu_scalar for every byte
+*/
+static inline __m256i alu_vector(int op, __m256i a, __m256i b, __m256i* vf) {
+    const __m256i one = _mm256_set1_epi8(1);
+    __m256i r;
+
+    switch(op) {
+        case 0x1: *vf = _mm256_setzero_si256(); return _mm256_or_si256(a, b);
+        case 0x2: *vf = _mm256_setzero_si256(); return _mm256_and_si256(a, b);
+        case 0x3: *vf = _mm256_setzero_si256(); return _mm256_xor_si256(a, b);
+        case 0x4:
+            //Carry where the saturating sum differs from the wrapping one
+            r = _mm256_add_epi8(a, b);
+            *vf = _mm256_andnot_si256(_mm256_cmpeq_epi8(_mm256_adds_epu8(a, b), r), one);
+            return r;
+        case 0x5:
+            *vf = _mm256_and_si256(_mm256_cmpeq_epi8(_mm256_max_epu8(a, b), a), one);
+            return _mm256_sub_epi8(a, b);
+        case 0x6:
+            //No byte shifts, shift words and drop the bit that crossed over
+            *vf = _mm256_and_si256(b, one);
+            return _mm256_and_si256(_mm256_srli_epi16(b, 1), _mm256_set1_epi8(0x7F));
+        case 0x7:
+            *vf = _mm256_and_si256(_mm256_cmpeq_epi8(_mm256_max_epu8(a, b), b), one);
+            return _mm256_sub_epi8(b, a);
+        case 0xE:
+            *vf = _mm256_and_si256(_mm256_srli_epi16(b, 7), one);
+            return _mm256_add_epi8(b, b);
+        default:
+            return b;
+    }
+}
+#endif
+
+/*
+    8xyN on every lane. The flag is stored after vx like the interpreter does, so x = F keeps
+    the flag, and y = F reads VF before it is overwritten.
+*/
+static void alu_lanes(struct chip8_lockstep* ls, int op, int x, int y) {
+    uint8_t* vx = REGISTER(ls, x);
+    const uint8_t* vy = REGISTER(ls, y);
+    uint8_t* vf = REGISTER(ls, 15);
+    int i = 0;
+
+#ifdef __AVX2__
+    for(;i < ls->stride;i += VECTOR_LANES) {
+        __m256i a = _mm256_load_si256((const __m256i*) (vx + i));
+        __m256i b = _mm256_load_si256((const __m256i*) (vy + i));
+        __m256i flag = _mm256_setzero_si256();
+        __m256i r = alu_vector(op, a, b, &flag);
+
+        _mm256_store_si256((__m256i*) (vx + i), r);
+        if(op) {
+            _mm256_store_si256((__m256i*) (vf + i), flag);
+        }
+    }
+#endif
+
+    for(;i < ls->stride;i++) {
+        uint8_t flag = 0;
+        uint8_t r = alu_scalar(op, vx[i], vy[i], &flag);
+
+        vx[i] = r;
+        if(op) {
+            vf[i] = flag;
+        }
+    }
+}
+
+/*
+    7xkk on every lane
+*/
+static void add_lanes(struct chip8_lockstep* ls, int x, uint8_t value) {
+    uint8_t* vx = REGISTER(ls, x);
+    int i = 0;
+
+#ifdef __AVX2__
+    __m256i k = _mm256_set1_epi8((char) value);
+    for(;i < ls->stride;i += VECTOR_LANES) {
+        __m256i a = _mm256_load_si256((const __m256i*) (vx + i));
+        _mm256_store_si256((__m256i*) (vx + i), _mm256_add_epi8(a, k));
+    }
+#endif
+
+    for(;i < ls->stride;i++) {
+        vx[i] += value;
+    }
+}
+
+/*
+    3xkk, 4xkk, 5xy0 and 9xy0 on every lane
+    @param b Register compared with, NULL to compare with value
+    @param equal Skip when equal rather than when not equal
+*/
+static void skip_lanes(struct chip8_lockstep* ls, const uint8_t* a, const uint8_t* b, uint8_t value, bool equal) {
+    int i = 0;
+
+    for(;i < ls->lanes;i++) {
+        bool same = a[i] == (b ? b[i] : value);
+        ls->pc[i] = (ls->pc[i] + (same == equal) * 2) & CHIP8_ADDRESS_MASK;
+    }
+}
+
+static void fill16(uint16_t* lanes, int count, uint16_t value) {
+    int i = 0;
+
+    for(;i < count;i++) {
+        lanes[i] = value;
+    }
+}
+
+/*
+    Runs an instruction that every lane fetched from the same address. Register opcodes
+    update all lanes at once, the rest fall back to one lane at a time.
+*/
+static void step_uniform(struct chip8_lockstep* ls, uint16_t instruction) {
+    int x = NIBBLE(2);
+    int y = NIBBLE(3);
+    uint8_t kk = instruction & 0xFF;
+    uint16_t nnn = instruction & 0xFFF;
+    int i = 0;
+
+    fill16(ls->pc, ls->lanes, (ls->pc[0] + 2) & CHIP8_ADDRESS_MASK);
+
+    switch(NIBBLE(1)) {
+        case 0x1:
+            fill16(ls->pc, ls->lanes, nnn);
+            return;
+        case 0x3:
+            skip_lanes(ls, REGISTER(ls, x), NULL, kk, true);
+            return;
+        case 0x4:
+            skip_lanes(ls, REGISTER(ls, x), NULL, kk, false);
+            return;
+        case 0x5:
+            skip_lanes(ls, REGISTER(ls, x), REGISTER(ls, y), 0, true);
+            return;
+        case 0x6:
+            memset(REGISTER(ls, x), kk, ls->stride);
+            return;
+        case 0x7:
+            add_lanes(ls, x, kk);
+            return;
+        case 0x8:
+            if((instruction & 0xF) <= 0x7 || (instruction & 0xF) == 0xE) {
+                alu_lanes(ls, instruction & 0xF, x, y);
+            }
+            return;
+        case 0x9:
+            skip_lanes(ls, REGISTER(ls, x), REGISTER(ls, y), 0, false);
+            return;
+        case 0xA:
+            fill16(ls->index_register, ls->lanes, nnn);
+            return;
+        case 0xF:
+            switch(kk) {
+                case 0x07:
+                    memcpy(REGISTER(ls, x), ls->delay_timer, ls->stride);
+                    return;
+                case 0x15:
+                    memcpy(ls->delay_timer, REGISTER(ls, x), ls->stride);
+                    return;
+                case 0x18:
+                    memcpy(ls->sound_timer, REGISTER(ls, x), ls->stride);
+                    return;
+                case 0x1E:
+                    for(;i < ls->lanes;i++) {
+                        ls->index_register[i] += REGISTER(ls, x)[i];
+                        REGISTER(ls, 15)[i] = ls->index_register[i] > 0xFFF;
+                    }
+                    return;
+                case 0x29:
+                    for(;i < ls->lanes;i++) {
+                        ls->index_register[i] = REGISTER(ls, x)[i] * 5;
+                    }
+                    return;
+            }
+            break;
+    }
+
+    for(;i < ls->lanes;i++) {
+        execute_lane(ls, i, instruction);
+    }
+}
+
+/*
+    @param instruction Receives the instruction every lane is about to run
+    @returns False if the lanes are at different addresses or their code differs
+*/
+static bool uniform_instruction(const struct chip8_lockstep* ls, uint16_t* instruction) {
+    uint16_t pc = ls->pc[0];
+    uint16_t first = chip8_instruction_at(&ls->vms[0], pc);
+    int i = 1;
+
+    for(;i < ls->lanes;i++) {
+        if(ls->pc[i] != pc) {
+            return false;
+        }
+    }
+
+    //Lanes may have written over their own code
+    for(i = 1;i < ls->lanes;i++) {
+        if(chip8_instruction_at(&ls->vms[i], pc) != first) {
+            return false;
+        }
+    }
+
+    *instruction = first;
+    return true;
+}
+
+/*
+    Runs one instruction on every lane
+*/
+static void step(struct chip8_lockstep* ls) {
+    uint16_t instruction;
+    int i = 0;
+
+    if(uniform_instruction(ls, &instruction)) {
+        ls->uniform++;
+        step_uniform(ls, instruction);
+        return;
+    }
+
+    ls->divergent++;
+    for(;i < ls->lanes;i++) {
+        uint16_t pc = ls->pc[i];
+
+        instruction = chip8_instruction_at(&ls->vms[i], pc);
+        ls->pc[i] = (pc + 2) & CHIP8_ADDRESS_MASK;
+        execute_lane(ls, i, instruction);
+    }
+}
+
+/*
+    @param lanes Number of machines, each gets its own memory, display and keypad
+    @param config Pacing of every lane. The tier is ignored. A fixed seed gives lane i the seed
+                  seed + i, without one every lane is seeded from the clock.
+    @returns NULL if out of memory or the headless backend failed
+*/
+struct chip8_lockstep* lockstep_create(int lanes, const struct chip8_config* config) {
+    struct chip8_lockstep* ls = calloc(1, sizeof(*ls));
+    struct chip8_config lane_config = *config;
+
+    if(!ls || lanes < 1) {
+        free(ls);
+        return NULL;
+    }
+
+    ls->lanes = lanes;
+    ls->stride = (lanes + VECTOR_LANES - 1) / VECTOR_LANES * VECTOR_LANES;
+    ls->v = aligned_alloc(VECTOR_LANES, (size_t) ls->stride * 16);
+    ls->pc = aligned_alloc(VECTOR_LANES, (size_t) ls->stride * sizeof(uint16_t));
+    ls->index_register = aligned_alloc(VECTOR_LANES, (size_t) ls->stride * sizeof(uint16_t));
+    ls->delay_timer = aligned_alloc(VECTOR_LANES, ls->stride);
+    ls->sound_timer = aligned_alloc(VECTOR_LANES, ls->stride);
+    ls->vms = calloc(lanes, sizeof(struct chip8_vm));
+    ls->lent = calloc(lanes, sizeof(bool));
+
+    if(!ls->v || !ls->pc || !ls->index_register || !ls->delay_timer || !ls->sound_timer || !ls->vms || !ls->lent) {
+        lockstep_destroy(ls);
+        return NULL;
+    }
+
+    memset(ls->v, 0, (size_t) ls->stride * 16);
+    memset(ls->delay_timer, 0, ls->stride);
+    memset(ls->sound_timer, 0, ls->stride);
+
+    //Every lane steps with execute_instruction, a cached decode would only go stale
+    lane_config.tier = CHIP8_TIER_INTERPRETER;
+
+    for(;ls->started < lanes;ls->started++) {
+        struct chip8_vm* vm = &ls->vms[ls->started];
+
+        chip8_init(vm, &headless_backend);
+        chip8_configure(vm, &lane_config);
+        if(config->seed) {
+            chip8_seed(vm, config->seed + ls->started);
+        }
+
+        if(!vm->io->initialize(vm)) {
+            chip8_release(vm);
+            lockstep_destroy(ls);
+            return NULL;
+        }
+
+        vm_to_lane(ls, ls->started);
+    }
+
+    return ls;
+}
+
+void lockstep_destroy(struct chip8_lockstep* ls) {
+    int i = 0;
+
+    if(!ls) {
+        return;
+    }
+
+    for(;i < ls->started;i++) {
+        ls->vms[i].io->close(&ls->vms[i]);
+        chip8_release(&ls->vms[i]);
+    }
+
+    free(ls->v);
+    free(ls->pc);
+    free(ls->index_register);
+    free(ls->delay_timer);
+    free(ls->sound_timer);
+    free(ls->vms);
+    free(ls->lent);
+    free(ls);
+}
+
+/*
+    Loads the same ROM file into every lane
+    @returns False if the file could not be read or does not fit in memory
+*/
+bool lockstep_load(struct chip8_lockstep* ls, const char* filepath) {
+    int i = 0;
+
+    for(;i < ls->lanes;i++) {
+        if(!chip8_load(&ls->vms[i], filepath)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/*
+    Loads the same ROM image into every lane
+    @returns False if the ROM is too large
+*/
+bool lockstep_load_rom(struct chip8_lockstep* ls, const uint8_t* rom, size_t size) {
+    int i = 0;
+
+    for(;i < ls->lanes;i++) {
+        if(!chip8_load_rom(&ls->vms[i], rom, size)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+int lockstep_lanes(const struct chip8_lockstep* ls) {
+    return ls->lanes;
+}
+
+void lockstep_seed(struct chip8_lockstep* ls, int lane, uint64_t seed) {
+    chip8_seed(&ls->vms[lane], seed);
+}
+
+/*
+    Sets the keys held down on a lane. Like a backend's handle_events this is meant to be called
+    once per frame: a key released by the call is the one Fx0A sees released in the next frame.
+    @param keypad Bit per key held down on the lane
+*/
+void lockstep_set_keypad(struct chip8_lockstep* ls, int lane, uint16_t keypad) {
+    struct chip8_vm* vm = &ls->vms[lane];
+    uint16_t released = atomic_exchange_explicit(&vm->keypad, keypad, memory_order_relaxed) & ~keypad;
+
+    vm->key_up = released ? __builtin_ctz(released) : CHIP8_NO_KEY;
+}
+
+/*
+    Runs one 60 Hz frame on every lane, the same as chip8_run_frame on each of them
+*/
+void lockstep_run_frame(struct chip8_lockstep* ls) {
+    uint64_t due = chip8_frame_instructions(&ls->vms[0]);
+    uint64_t count = chip8_limit_instructions(&ls->vms[0], due);
+    uint64_t n = 0;
+    int i = 0;
+
+    for(;i < ls->lanes;i++) {
+        if(ls->lent[i]) {
+            vm_to_lane(ls, i);
+            ls->lent[i] = false;
+        }
+        ls->vms[i].vblank = true;
+    }
+
+    for(;n < count;n++) {
+        step(ls);
+    }
+
+    for(i = 0;i < ls->lanes;i++) {
+        struct chip8_vm* vm = &ls->vms[i];
+
+        vm->cycles += count;
+        //A frame cut short by the cycle limit stops before its timers
+        if(count < due) {
+            continue;
+        }
+        vm->io->set_sound(vm, ls->sound_timer[i] > 0);
+        ls->sound_timer[i] -= ls->sound_timer[i] > 0;
+        ls->delay_timer[i] -= ls->delay_timer[i] > 0;
+        vm->frames++;
+    }
+}
+
+/*
+    Runs frames until the headless backend stops any lane, the script and cycle limit apply to every lane
+*/
+void lockstep_run(struct chip8_lockstep* ls) {
+    bool running = true;
+    int i;
+
+    while(running) {
+        for(i = 0;i < ls->lanes;i++) {
+            running = ls->vms[i].io->handle_events(&ls->vms[i]) && running;
+        }
+
+        if(running) {
+            lockstep_run_frame(ls);
+        }
+    }
+
+    for(i = 0;i < ls->lanes;i++) {
+        lane_to_vm(ls, i);
+        ls->vms[i].io->draw(&ls->vms[i]);
+    }
+}
+
+/*
+    @returns The lane's machine with its registers up to date. It stays valid until lockstep_destroy,
+             and changes made to it before the next frame, registers included, are kept.
+*/
+struct chip8_vm* lockstep_lane(struct chip8_lockstep* ls, int lane) {
+    lane_to_vm(ls, lane);
+    ls->lent[lane] = true;
+    return &ls->vms[lane];
+}
+
+/*
+    @param uniform Receives the number of instructions run on all lanes at once
+    @param divergent Receives the number of instructions run one lane at a time
+*/
+void lockstep_counts(const struct chip8_lockstep* ls, uint64_t* uniform, uint64_t* divergent) {
+    *uniform = ls->uniform;
+    *divergent = ls->divergent;
+}
+
+#undef VECTOR_LANES
+#undef NIBBLE
+#undef REGISTER
@@ -0,0 +1,24 @@
+#ifndef LOCKSTEP_H
+#define LOCKSTEP_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+struct chip8_vm;
+struct chip8_config;
+struct chip8_lockstep;
+
+struct chip8_lockstep* lockstep_create(int lanes, const struct chip8_config* config);
+void lockstep_destroy(struct chip8_lockstep* ls);
+bool lockstep_load(struct chip8_lockstep* ls, const char* filepath);
+bool lockstep_load_rom(struct chip8_lockstep* ls, const uint8_t* rom, size_t size);
+int lockstep_lanes(const struct chip8_lockstep* ls);
+void lockstep_seed(struct chip8_lockstep* ls, int lane, uint64_t seed);
+void lockstep_set_keypad(struct chip8_lockstep* ls, int lane, uint16_t keypad);
+void lockstep_run_frame(struct chip8_lockstep* ls);
+void lockstep_run(struct chip8_lockstep* ls);
+struct chip8_vm* lockstep_lane(struct chip8_lockstep* ls, int lane);
+void lockstep_counts(const struct chip8_lockstep* ls, uint64_t* uniform, uint64_t* divergent);
+
+#endif
@@ -1,8 +1,345 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "batch.h"
+#include "capture.h"
 #include "chip8.h"
+#include "diffcheck.h"
+#include "headless.h"
+#include "instrument.h"
+#include "profile.h"
+#include "replay.h"
+#ifndef CHIP8_NO_SDL
+#include "display.h"
+#endif
 
+#ifdef CHIP8_AOT
+//Generated by chip8_aot and linked into this build
+extern const struct chip8_native chip8_aot_program;
+#endif
+
+/*
+    Runs every ROM instances times on the headless backend and prints one line per machine
+*/
+static int batch(char** roms, int num_roms, int instances, int threads, const struct chip8_config* config, const char* capture, bool lockstep) {
+    int count = num_roms * instances;
+    struct batch_job* jobs = calloc(count, sizeof(*jobs));
+    //Capture files are named path-0.gif, path-1.gif and so on
+    size_t path_size = capture ? strlen(capture) + 16 : 0;
+    char* paths = calloc(count, path_size ? path_size : 1);
+
+    if(!jobs || !paths) {
+        free(jobs);
+        free(paths);
+        return -1;
+    }
+
+    int i = 0;
+    for(;i < count;i++) {
+        jobs[i].rom = roms[i % num_roms];
+
+        if(capture) {
+            const char* dot = strrchr(capture, '.');
+            const char* slash = strrchr(capture, '/');
+            int stem = dot && (!slash || dot > slash) ? (int) (dot - capture) : (int) strlen(capture);
+
+            jobs[i].capture = paths + i * path_size;
+            snprintf(paths + i * path_size, path_size, "%.*s-%d%s", stem, capture, i, capture + stem);
+        }
+    }
+
+    if(lockstep ? !run_lockstep(jobs, count, config) : !run_batch(jobs, count, threads, config)) {
+        printf(lockstep ? "Couldn't create lockstep machines\n" : "Couldn't start worker threads\n");
+        free(jobs);
+        free(paths);
+        return -1;
+    }
+
+    for(i = 0;i < count;i++) {
+        printf("%d %s %s cycles=%llu frames=%llu display=%016llx\n", i, jobs[i].rom, jobs[i].ok ? "ok" : "failed",
+            (unsigned long long) jobs[i].cycles, (unsigned long long) jobs[i].frames, (unsigned long long) jobs[i].display_hash);
+    }
+
+    free(jobs);
+    free(paths);
+    return 0;
+}
+
+/*
+    Repeats a recorded session headless and unthrottled
+*/
+static int replay(char* rom, const char* log_path, const struct chip8_config* config, struct chip8_capture* capture) {
+    struct chip8_input_log* log = input_log_read(log_path);
+    struct chip8_vm* vm = malloc(sizeof(*vm));
+    int result = -1;
+
+    if(!log || !vm) {
+        printf("Couldn't read input log %s\n", log_path);
+    }
+    else {
+        chip8_init(vm, &headless_backend);
+        chip8_configure(vm, config);
+
+        if(!chip8_load(vm, rom) || !vm->io->initialize(vm)) {
+            printf("Couldn't open file %s\n", rom);
+        }
+        else {
+            vm->capture = capture;
+            input_log_replay(log, vm);
+            printf("cycles=%llu frames=%llu\n", (unsigned long long) vm->cycles, (unsigned long long) vm->frames);
+            vm->io->close(vm);
+            result = 0;
+        }
+        chip8_release(vm);
+    }
+
+    input_log_destroy(log);
+    free(vm);
+    return result;
+}
+
+/*
+    Runs the ROM headless on the configured tier and on the interpreter side by side
+    @returns 1 if the machines diverged
+*/
+static int diffcheck(char* rom, const struct chip8_config* config, uint64_t interval) {
+    struct chip8_diffcheck* dc = diffcheck_create(config, interval);
+    int result = -1;
+
+    if(!dc || !diffcheck_load(dc, rom)) {
+        printf("Couldn't open file %s\n", rom);
+    }
+    else {
+        result = diffcheck_run(dc) ? 0 : 1;
+        diffcheck_report(dc, stdout);
+    }
+
+    diffcheck_destroy(dc);
+    return result;
+}
+
+/*
+    Writes prefix.asm and prefix.folded
+*/
+static bool write_profile(const struct chip8_profile* profile, const char* prefix) {
+    size_t length = strlen(prefix) + sizeof(".folded");
+    char* path = malloc(length);
+    bool ok = path != NULL;
+
+    if(ok) {
+        snprintf(path, length, "%s.asm", prefix);
+        ok = profile_write_disassembly(profile, path);
+        snprintf(path, length, "%s.folded", prefix);
+        ok = profile_write_folded(profile, path) && ok;
+    }
+
+    free(path);
+    return ok;
+}
+
+/*
+    Usage: chip8 [-headless] [-script file] [-cycles n] [-print] [-instances n] [-threads n] [-lockstep] [-tier name]
+                 [-cpf n] [-turbo n] [-unthrottled] [-no-display-wait] [-seed n] [-record file] [-replay file]
+                 [-profile prefix] [-capture path] [-diffcheck n] [-stats file] [-stats-shm name] [rom...]
+    -headless   Run without window, vsync or audio at full speed
+    -script     Key script for the headless backend
+    -cycles     Stop the headless backend after exactly n instructions
+    -print      Print the headless framebuffer when the emulator stops
+    -instances  Run every ROM n times on the headless backend
+    -threads    Worker threads for multiple instances, defaults to one per core
+    -lockstep   Run the instances of one ROM together on one thread, vectorizing the instructions they share.
+                Instance i is seeded with seed + i
+    -tier       interpreter, predecode or jit, defaults to predecode
+    -cpf        Instructions per 60 Hz frame, defaults to 700 Hz
+    -turbo      Fast forward, run n frames every 1/60 s
+    -unthrottled    Run as fast as possible with no display wait
+    -no-display-wait    Let Dxyn draw more than one sprite per frame
+    -seed       Seed for Cxkk, defaults to the clock
+    -record     Write the session's seed and keyboard changes to file
+    -replay     Repeat a recorded session headless as fast as possible
+    -profile    Run on the interpreter and write prefix.asm, an annotated disassembly, and prefix.folded call stacks
+    -capture    Record every frame to path.gif, path.raw (64x32 grayscale) or PNG files named pathNNNNNN.png
+    -diffcheck  Run headless on the tier and the interpreter together, comparing them every n instructions,
+                and report the first instruction where they differ
+    -stats      Write counters to file every second of frames, builds with CHIP8_INSTRUMENT only
+    -stats-shm  Keep counters in a POSIX shared memory object, builds with CHIP8_INSTRUMENT only
+*/
 int main(int argc, char* argv[]){
-    run_chip("games/PONG");
+    char** roms = calloc(argc, sizeof(char*));
+    int num_roms = 0;
+    int instances = 1;
+    int threads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+    char* record_path = NULL;
+    char* replay_path = NULL;
+    char* profile_prefix = NULL;
+    char* capture_path = NULL;
+    bool lockstep = false;
+    bool check = false;
+    uint64_t check_interval = 0;
+    struct chip8_config config;
+#ifdef CHIP8_NO_SDL
+    const struct backend* backend = &headless_backend;
+#else
+    const struct backend* backend = &sdl_backend;
+#endif
+
+    chip8_default_config(&config);
+#ifdef CHIP8_AOT
+    chip8_register_native(&chip8_aot_program);
+#endif
+
+    int i = 1;
+    for(;i < argc;i++) {
+        if(!strcmp(argv[i], "-headless")) {
+            backend = &headless_backend;
+        }
+        else if(!strcmp(argv[i], "-script") && i + 1 < argc) {
+            if(!headless_load_script(argv[++i])) {
+                printf("Couldn't read script %s\n", argv[i]);
+                return -1;
+            }
+        }
+        else if(!strcmp(argv[i], "-cycles") && i + 1 < argc) {
+            headless_set_cycle_limit(strtoull(argv[++i], NULL, 10));
+        }
+        else if(!strcmp(argv[i], "-print")) {
+            headless_set_print(stdout);
+        }
+        else if(!strcmp(argv[i], "-instances") && i + 1 < argc) {
+            instances = atoi(argv[++i]);
+        }
+        else if(!strcmp(argv[i], "-threads") && i + 1 < argc) {
+            threads = atoi(argv[++i]);
+        }
+        else if(!strcmp(argv[i], "-lockstep")) {
+            lockstep = true;
+        }
+        else if(!strcmp(argv[i], "-tier") && i + 1 < argc) {
+            i++;
+            if(!strcmp(argv[i], "interpreter")) {
+                config.tier = CHIP8_TIER_INTERPRETER;
+            }
+            else if(!strcmp(argv[i], "predecode")) {
+                config.tier = CHIP8_TIER_PREDECODE;
+            }
+            else if(!strcmp(argv[i], "jit")) {
+                config.tier = CHIP8_TIER_JIT;
+            }
+            else {
+                printf("Unknown tier %s\n", argv[i]);
+                return -1;
+            }
+        }
+        else if(!strcmp(argv[i], "-cpf") && i + 1 < argc) {
+            config.cycles_per_frame = atoi(argv[++i]);
+        }
+        else if(!strcmp(argv[i], "-turbo") && i + 1 < argc) {
+            config.turbo = atoi(argv[++i]);
+        }
+        else if(!strcmp(argv[i], "-unthrottled")) {
+            config.unthrottled = true;
+        }
+        else if(!strcmp(argv[i], "-no-display-wait")) {
+            config.display_wait = false;
+        }
+        else if(!strcmp(argv[i], "-seed") && i + 1 < argc) {
+            config.seed = strtoull(argv[++i], NULL, 0);
+        }
+        else if(!strcmp(argv[i], "-record") && i + 1 < argc) {
+            record_path = argv[++i];
+        }
+        else if(!strcmp(argv[i], "-replay") && i + 1 < argc) {
+            replay_path = argv[++i];
+        }
+        else if(!strcmp(argv[i], "-profile") && i + 1 < argc) {
+            profile_prefix = argv[++i];
+        }
+        else if(!strcmp(argv[i], "-capture") && i + 1 < argc) {
+            capture_path = argv[++i];
+        }
+        else if(!strcmp(argv[i], "-diffcheck") && i + 1 < argc) {
+            check = true;
+            check_interval = strtoull(argv[++i], NULL, 10);
+        }
+#ifdef CHIP8_INSTRUMENT
+        else if(!strcmp(argv[i], "-stats") && i + 1 < argc) {
+            instrument_set_snapshot(argv[++i], 60);
+        }
+        else if(!strcmp(argv[i], "-stats-shm") && i + 1 < argc) {
+            if(!instrument_set_shared(argv[++i])) {
+                printf("Couldn't map shared memory %s\n", argv[i]);
+                return -1;
+            }
+        }
+#endif
+        else {
+            roms[num_roms++] = argv[i];
+        }
+    }
+
+    if(!num_roms) {
+        printf("Usage: chip8 [options] rom...\n");
+        free(roms);
+        return -1;
+    }
+
+    if(lockstep && (num_roms > 1 || capture_path)) {
+        printf("-lockstep runs one ROM without -capture\n");
+        free(roms);
+        return -1;
+    }
+
+    if(num_roms > 1 || instances > 1) {
+        headless_set_print(NULL);
+        int result = batch(roms, num_roms, instances > 0 ? instances : 1, threads, &config, capture_path, lockstep);
+        free(roms);
+        return result;
+    }
+
+    if(check) {
+        int result = diffcheck(roms[0], &config, check_interval);
+        free(roms);
+        return result;
+    }
+
+    struct chip8_session session = {NULL, NULL, NULL};
+    if(capture_path && !(session.capture = capture_start(capture_path, capture_format_from_path(capture_path)))) {
+        printf("Couldn't capture to %s\n", capture_path);
+        free(roms);
+        return -1;
+    }
+
+    if(replay_path) {
+        int result = replay(roms[0], replay_path, &config, session.capture);
+        if(session.capture) {
+            capture_stop(session.capture);
+        }
+        free(roms);
+        return result;
+    }
+
+    session.record = record_path ? input_log_create() : NULL;
+    session.profile = profile_prefix ? profile_create() : NULL;
+    run_chip(roms[0], backend, &config, &session);
+
+    if(session.capture && capture_stop(session.capture)) {
+        printf("Capture fell behind, frames were dropped\n");
+    }
+
+    struct chip8_input_log* log = session.record;
+    struct chip8_profile* profile = session.profile;
+
+    if(log && !input_log_write(log, record_path)) {
+        printf("Couldn't write input log %s\n", record_path);
+    }
+    input_log_destroy(log);
+
+    if(profile && !write_profile(profile, profile_prefix)) {
+        printf("Couldn't write profile %s\n", profile_prefix);
+    }
+    profile_destroy(profile);
+    free(roms);
     return 0;
 
-}
\ No newline at end of file
+}
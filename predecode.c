@@ -0,0 +1,550 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "chip8.h"
+#include "instrument.h"
+#include "predecode.h"
+
+#define DEBUG 0
+#define NIBBLE(n) ((instruction >> (16 - n * 4)) & 0xF)
+//Most instructions one fused record runs
+#define MAX_FUSED 3
+
+/*
+    Decodes an instruction into a handler index and its operands.
+    Must map every instruction the same way execute_instruction does.
+    @param instruction Chip8 instruction to decode
+    @param d Record to fill in
+*/
+void chip8_decode(uint16_t instruction, struct chip8_decoded* d) {
+    d->x = NIBBLE(2);
+    d->y = NIBBLE(3);
+    d->n = NIBBLE(4);
+    d->kk = instruction & 0xFF;
+    d->nnn = instruction & 0xFFF;
+    d->op = OP_UNKNOWN;
+
+    switch (NIBBLE(1)) {
+        case 0x0:
+            if(instruction == 0xE0) {
+                d->op = OP_CLS;
+            }
+            else if(instruction == 0xEE) {
+                d->op = OP_RET;
+            }
+            break;
+        case 0x1: d->op = OP_JP; break;
+        case 0x2: d->op = OP_CALL; break;
+        case 0x3: d->op = OP_SE_IMM; break;
+        case 0x4: d->op = OP_SNE_IMM; break;
+        case 0x5: d->op = OP_SE_REG; break;
+        case 0x6: d->op = OP_LD_IMM; break;
+        case 0x7: d->op = OP_ADD_IMM; break;
+        case 0x8:
+            switch (instruction & 0xF) {
+                case 0x0: d->op = OP_LD_REG; break;
+                case 0x1: d->op = OP_OR; break;
+                case 0x2: d->op = OP_AND; break;
+                case 0x3: d->op = OP_XOR; break;
+                case 0x4: d->op = OP_ADD_REG; break;
+                case 0x5: d->op = OP_SUB; break;
+                case 0x6: d->op = OP_SHR; break;
+                case 0x7: d->op = OP_SUBN; break;
+                case 0xE: d->op = OP_SHL; break;
+            }
+            break;
+        case 0x9: d->op = OP_SNE_REG; break;
+        case 0xA: d->op = OP_LD_I; break;
+        case 0xB: d->op = OP_JP_V0; break;
+        case 0xC: d->op = OP_RND; break;
+        case 0xD: d->op = OP_DRW; break;
+        case 0xE:
+            switch (instruction & 0xF) {
+                case 0xE: d->op = OP_SKP; break;
+                case 0x1: d->op = OP_SKNP; break;
+            }
+            break;
+        case 0xF:
+            switch (instruction & 0xFF) {
+                case 0x07: d->op = OP_LD_VX_DT; break;
+                case 0x0A: d->op = OP_LD_KEY; break;
+                case 0x15: d->op = OP_LD_DT; break;
+                case 0x18: d->op = OP_LD_ST; break;
+                case 0x1E: d->op = OP_ADD_I; break;
+                case 0x29: d->op = OP_LD_FONT; break;
+                case 0x33: d->op = OP_BCD; break;
+                case 0x55: d->op = OP_STORE; break;
+                case 0x65: d->op = OP_LOAD; break;
+            }
+            break;
+    }
+}
+
+#ifndef CHIP8_INSTRUMENT
+/*
+    Replaces a decoded instruction with a fused handler when it starts one of the common sequences:
+    sprite setup, a counter bumped and tested at the bottom of a loop, and registers loaded for arithmetic.
+    Jumps into the middle of a sequence still find the plain record of that address.
+    Jumps that may close a wait for the next frame are marked here too.
+    @param vm Machine the instruction was decoded from
+    @param address Address of the instruction
+    @param d Decoded instruction, rewritten in place
+*/
+static void fuse(const struct chip8_vm* vm, uint16_t address, struct chip8_decoded* d) {
+    struct chip8_decoded second;
+    struct chip8_decoded third;
+
+    chip8_decode(chip8_instruction_at(vm, address + 2), &second);
+
+    if(d->op == OP_LD_I && second.op == OP_DRW) {
+        d->op = OP_LD_I_DRW;
+        d->x = second.x;
+        d->y = second.y;
+        d->n = second.n;
+    }
+    else if(d->op == OP_LD_IMM && second.op == OP_LD_IMM) {
+        d->op = OP_LD_IMM2;
+        d->y = second.x;
+        d->n = second.kk;
+    }
+    else if(d->op == OP_ADD_IMM && (second.op == OP_SE_IMM || second.op == OP_SNE_IMM)) {
+        chip8_decode(chip8_instruction_at(vm, address + 4), &third);
+        if(third.op == OP_JP) {
+            d->op = second.op == OP_SE_IMM ? OP_ADD_SE_JP : OP_ADD_SNE_JP;
+            d->y = second.x;
+            d->n = second.kk;
+            d->nnn = third.nnn;
+        }
+    }
+    else if(d->op == OP_LOAD && second.op >= OP_LD_REG && second.op <= OP_SHL) {
+        d->op = OP_LOAD_ALU;
+        d->y = second.x;
+        d->n = second.y;
+        d->kk = second.op;
+    }
+    //A jump to itself or back to an Fx07 3xkk 1nnn loop, the only jumps chip8_skip_idle can skip after
+    else if(d->op == OP_JP && (d->nnn == address || d->nnn == ((address - 4) & CHIP8_ADDRESS_MASK))) {
+        d->op = OP_JP_IDLE;
+    }
+}
+#endif
+
+/*
+    Runs one 8xyN instruction for the fused handlers, the same as its own handler
+    @param op OP_LD_REG to OP_SHL
+*/
+static inline void alu(uint8_t* registers, uint8_t op, uint8_t x, uint8_t y) {
+    int temp;
+
+    switch(op) {
+        case OP_LD_REG: registers[x] = registers[y]; break;
+        case OP_OR: registers[x] |= registers[y]; registers[15] = 0; break;
+        case OP_AND: registers[x] &= registers[y]; registers[15] = 0; break;
+        case OP_XOR: registers[x] ^= registers[y]; registers[15] = 0; break;
+        case OP_ADD_REG:
+            temp = registers[x] + registers[y];
+            registers[x] = temp & 0xFF;
+            registers[15] = temp >= 256;
+            break;
+        case OP_SUB:
+            temp = registers[x] - registers[y];
+            registers[x] = temp;
+            registers[15] = temp >= 0;
+            break;
+        case OP_SHR:
+            temp = registers[y] & 0x1;
+            registers[x] = registers[y] >> 1;
+            registers[15] = temp;
+            break;
+        case OP_SUBN:
+            temp = registers[y] - registers[x];
+            registers[x] = temp;
+            registers[15] = temp >= 0;
+            break;
+        case OP_SHL:
+            temp = registers[y] >> 7;
+            registers[x] = registers[y] << 1;
+            registers[15] = temp;
+            break;
+    }
+}
+
+/*
+    Allocates a decode cache with every address undecoded
+    @returns NULL if out of memory
+*/
+struct chip8_decoded* predecode_create(void) {
+    //OP_DECODE is zero
+    return calloc(CHIP8_MEMORY_SIZE, sizeof(struct chip8_decoded));
+}
+
+/*
+    Drops cached decodes of every instruction overlapping the written bytes
+    @param address First byte written
+    @param length Number of bytes written
+*/
+void predecode_invalidate(struct chip8_decoded* decoded, uint16_t address, uint16_t length) {
+    //A fused record reads the instructions after its own, so records up to
+    //2 * MAX_FUSED - 1 bytes before the write may have read the first written byte
+    uint16_t first = address - (2 * MAX_FUSED - 1);
+    uint16_t span = length + 2 * MAX_FUSED - 1;
+    uint16_t i = 0;
+    for(;i < span && i < CHIP8_MEMORY_SIZE;i++) {
+        decoded[(first + i) & CHIP8_ADDRESS_MASK].op = OP_DECODE;
+    }
+}
+
+/*
+    Executes instructions through the decode cache. Each address is decoded on first
+    use and every handler jumps straight to the next one (computed goto on GCC and Clang).
+    @param count Number of instructions to execute
+*/
+void predecode_run(struct chip8_vm* vm, uint64_t count) {
+    struct chip8_decoded* const decoded = vm->decoded;
+    uint8_t* const registers = vm->registers;
+    uint16_t pc = vm->pc;
+    struct chip8_decoded* d;
+    //First instruction of a fused record that doesn't fit in count
+    struct chip8_decoded single;
+
+    vm->cycles += count;
+
+#define SINGLE() \
+    do { \
+        chip8_decode(chip8_instruction_at(vm, pc - 2), &single); \
+        d = &single; \
+        REDISPATCH(); \
+    } while(0)
+
+//Spends the rest of count at once when the machine waits for the next frame
+#define IDLE() \
+    do { \
+        vm->pc = pc; \
+        count -= chip8_skip_idle(vm, LEFT()); \
+        pc = vm->pc; \
+    } while(0)
+
+#ifdef __GNUC__
+    static const void* const labels[NUM_HANDLERS] = {
+        [OP_DECODE] = &&op_OP_DECODE, [OP_UNKNOWN] = &&op_OP_UNKNOWN,
+        [OP_CLS] = &&op_OP_CLS, [OP_RET] = &&op_OP_RET, [OP_JP] = &&op_OP_JP, [OP_CALL] = &&op_OP_CALL,
+        [OP_SE_IMM] = &&op_OP_SE_IMM, [OP_SNE_IMM] = &&op_OP_SNE_IMM, [OP_SE_REG] = &&op_OP_SE_REG,
+        [OP_LD_IMM] = &&op_OP_LD_IMM, [OP_ADD_IMM] = &&op_OP_ADD_IMM, [OP_LD_REG] = &&op_OP_LD_REG,
+        [OP_OR] = &&op_OP_OR, [OP_AND] = &&op_OP_AND, [OP_XOR] = &&op_OP_XOR, [OP_ADD_REG] = &&op_OP_ADD_REG,
+        [OP_SUB] = &&op_OP_SUB, [OP_SHR] = &&op_OP_SHR, [OP_SUBN] = &&op_OP_SUBN, [OP_SHL] = &&op_OP_SHL,
+        [OP_SNE_REG] = &&op_OP_SNE_REG, [OP_LD_I] = &&op_OP_LD_I, [OP_JP_V0] = &&op_OP_JP_V0,
+        [OP_RND] = &&op_OP_RND, [OP_DRW] = &&op_OP_DRW, [OP_SKP] = &&op_OP_SKP, [OP_SKNP] = &&op_OP_SKNP,
+        [OP_LD_VX_DT] = &&op_OP_LD_VX_DT, [OP_LD_KEY] = &&op_OP_LD_KEY, [OP_LD_DT] = &&op_OP_LD_DT,
+        [OP_LD_ST] = &&op_OP_LD_ST, [OP_ADD_I] = &&op_OP_ADD_I, [OP_LD_FONT] = &&op_OP_LD_FONT,
+        [OP_BCD] = &&op_OP_BCD, [OP_STORE] = &&op_OP_STORE, [OP_LOAD] = &&op_OP_LOAD,
+        [OP_LD_I_DRW] = &&op_OP_LD_I_DRW, [OP_LD_IMM2] = &&op_OP_LD_IMM2, [OP_ADD_SE_JP] = &&op_OP_ADD_SE_JP,
+        [OP_ADD_SNE_JP] = &&op_OP_ADD_SNE_JP, [OP_LOAD_ALU] = &&op_OP_LOAD_ALU, [OP_JP_IDLE] = &&op_OP_JP_IDLE
+    };
+
+#define HANDLER(op) op_##op:
+#define REDISPATCH() goto *labels[d->op]
+#define NEXT() \
+    do { \
+        if(!count--) { \
+            goto done; \
+        } \
+        d = &decoded[pc]; \
+        CHIP8_INSTRUMENT_INSTRUCTION(vm, pc); \
+        pc = (pc + 2) & CHIP8_ADDRESS_MASK; \
+        goto *labels[d->op]; \
+    } while(0)
+//Instructions left after the current one
+#define LEFT() count
+
+    NEXT();
+    {
+#else
+#define HANDLER(op) case op:
+#define REDISPATCH() goto dispatch
+#define NEXT() continue
+#define LEFT() (count - 1)
+
+    for(;count;count--) {
+        d = &decoded[pc];
+        CHIP8_INSTRUMENT_INSTRUCTION(vm, pc);
+        pc = (pc + 2) & CHIP8_ADDRESS_MASK;
+dispatch:
+        switch(d->op) {
+#endif
+        HANDLER(OP_DECODE) {
+            uint16_t at = (pc - 2) & CHIP8_ADDRESS_MASK;
+            chip8_decode(chip8_instruction_at(vm, at), d);
+#ifndef CHIP8_INSTRUMENT
+            //Instrumented builds count every instruction on its own
+            fuse(vm, at, d);
+#endif
+            REDISPATCH();
+        }
+
+        HANDLER(OP_UNKNOWN)
+            if(DEBUG) {
+                printf("\nInstruction not found at: %x\n", (pc - 2) & CHIP8_ADDRESS_MASK);
+            }
+            NEXT();
+
+        HANDLER(OP_CLS)
+            chip8_clear_screen(vm);
+            NEXT();
+
+        HANDLER(OP_RET)
+            pc = vm->stack[--vm->stack_ptr & 0xF];
+            NEXT();
+
+        HANDLER(OP_JP)
+            pc = d->nnn;
+            NEXT();
+
+        HANDLER(OP_CALL)
+            vm->stack[vm->stack_ptr++ & 0xF] = pc;
+            pc = d->nnn;
+            NEXT();
+
+        HANDLER(OP_SE_IMM)
+            if(registers[d->x] == d->kk) {
+                pc = (pc + 2) & CHIP8_ADDRESS_MASK;
+            }
+            NEXT();
+
+        HANDLER(OP_SNE_IMM)
+            if(registers[d->x] != d->kk) {
+                pc = (pc + 2) & CHIP8_ADDRESS_MASK;
+            }
+            NEXT();
+
+        HANDLER(OP_SE_REG)
+            if(registers[d->x] == registers[d->y]) {
+                pc = (pc + 2) & CHIP8_ADDRESS_MASK;
+            }
+            NEXT();
+
+        HANDLER(OP_LD_IMM)
+            registers[d->x] = d->kk;
+            NEXT();
+
+        HANDLER(OP_ADD_IMM)
+            registers[d->x] += d->kk;
+            NEXT();
+
+        HANDLER(OP_LD_REG)
+            registers[d->x] = registers[d->y];
+            NEXT();
+
+        HANDLER(OP_OR)
+            registers[d->x] |= registers[d->y];
+            registers[15] = 0;
+            NEXT();
+
+        HANDLER(OP_AND)
+            registers[d->x] &= registers[d->y];
+            registers[15] = 0;
+            NEXT();
+
+        HANDLER(OP_XOR)
+            registers[d->x] ^= registers[d->y];
+            registers[15] = 0;
+            NEXT();
+
+        HANDLER(OP_ADD_REG) {
+            uint16_t temp = registers[d->x] + registers[d->y];
+            registers[d->x] = temp & 0xFF;
+            registers[15] = temp >= 256;
+            NEXT();
+        }
+
+        HANDLER(OP_SUB) {
+            int16_t temp = registers[d->x] - registers[d->y];
+            registers[d->x] = temp;
+            registers[15] = temp >= 0;
+            NEXT();
+        }
+
+        HANDLER(OP_SHR) {
+            uint8_t temp = registers[d->y] & 0x1;
+            registers[d->x] = registers[d->y] >> 1;
+            registers[15] = temp;
+            NEXT();
+        }
+
+        HANDLER(OP_SUBN) {
+            int16_t temp = registers[d->y] - registers[d->x];
+            registers[d->x] = temp;
+            registers[15] = temp >= 0;
+            NEXT();
+        }
+
+        HANDLER(OP_SHL) {
+            uint8_t temp = registers[d->y] >> 7;
+            registers[d->x] = registers[d->y] << 1;
+            registers[15] = temp;
+            NEXT();
+        }
+
+        HANDLER(OP_SNE_REG)
+            if(registers[d->x] != registers[d->y]) {
+                pc = (pc + 2) & CHIP8_ADDRESS_MASK;
+            }
+            NEXT();
+
+        HANDLER(OP_LD_I)
+            vm->index_register = d->nnn;
+            NEXT();
+
+        HANDLER(OP_JP_V0)
+            pc = (registers[0] + d->nnn) & CHIP8_ADDRESS_MASK;
+            NEXT();
+
+        HANDLER(OP_RND)
+            registers[d->x] = chip8_random(vm) & d->kk;
+            NEXT();
+
+        HANDLER(OP_DRW)
+            if(!chip8_draw_sprite(vm, d->x, d->y, d->n)) {
+                pc = (pc - 2) & CHIP8_ADDRESS_MASK;
+                IDLE();
+            }
+            NEXT();
+
+        HANDLER(OP_SKP)
+            if(chip8_key_down(vm, registers[d->x])) {
+                pc = (pc + 2) & CHIP8_ADDRESS_MASK;
+            }
+            NEXT();
+
+        HANDLER(OP_SKNP)
+            if(!chip8_key_down(vm, registers[d->x])) {
+                pc = (pc + 2) & CHIP8_ADDRESS_MASK;
+            }
+            NEXT();
+
+        HANDLER(OP_LD_VX_DT)
+            registers[d->x] = vm->delay_timer;
+            NEXT();
+
+        HANDLER(OP_LD_KEY)
+            if(!chip8_key_pressed(vm, &registers[d->x])) {
+                pc = (pc - 2) & CHIP8_ADDRESS_MASK;
+                IDLE();
+            }
+            NEXT();
+
+        HANDLER(OP_LD_DT)
+            vm->delay_timer = registers[d->x];
+            NEXT();
+
+        HANDLER(OP_LD_ST)
+            vm->sound_timer = registers[d->x];
+            NEXT();
+
+        HANDLER(OP_ADD_I)
+            vm->index_register += registers[d->x];
+            registers[15] = vm->index_register > 0xFFF;
+            NEXT();
+
+        HANDLER(OP_LD_FONT)
+            vm->index_register = registers[d->x] * 5;
+            NEXT();
+
+        HANDLER(OP_BCD)
+            chip8_store_bcd(vm, d->x);
+            NEXT();
+
+        HANDLER(OP_STORE)
+            chip8_store_registers(vm, d->x);
+            NEXT();
+
+        HANDLER(OP_LOAD)
+            chip8_load_registers(vm, d->x);
+            NEXT();
+
+        //Fused handlers count every instruction they run. Near the end of count they run
+        //only their first instruction, decoded again without fusion.
+        HANDLER(OP_LD_I_DRW)
+            if(LEFT() < 1) {
+                SINGLE();
+            }
+            count--;
+            vm->index_register = d->nnn;
+            if(chip8_draw_sprite(vm, d->x, d->y, d->n)) {
+                pc = (pc + 2) & CHIP8_ADDRESS_MASK;
+            }
+            else {
+                IDLE();
+            }
+            NEXT();
+
+        HANDLER(OP_LD_IMM2)
+            if(LEFT() < 1) {
+                SINGLE();
+            }
+            count--;
+            registers[d->x] = d->kk;
+            registers[d->y] = d->n;
+            pc = (pc + 2) & CHIP8_ADDRESS_MASK;
+            NEXT();
+
+        HANDLER(OP_ADD_SE_JP)
+            if(LEFT() < 2) {
+                SINGLE();
+            }
+            registers[d->x] += d->kk;
+            //A taken skip steps over the jump
+            if(registers[d->y] == d->n) {
+                count--;
+                pc = (pc + 4) & CHIP8_ADDRESS_MASK;
+            }
+            else {
+                count -= 2;
+                pc = d->nnn;
+            }
+            NEXT();
+
+        HANDLER(OP_ADD_SNE_JP)
+            if(LEFT() < 2) {
+                SINGLE();
+            }
+            registers[d->x] += d->kk;
+            if(registers[d->y] != d->n) {
+                count--;
+                pc = (pc + 4) & CHIP8_ADDRESS_MASK;
+            }
+            else {
+                count -= 2;
+                pc = d->nnn;
+            }
+            NEXT();
+
+        HANDLER(OP_LOAD_ALU)
+            if(LEFT() < 1) {
+                SINGLE();
+            }
+            count--;
+            chip8_load_registers(vm, d->x);
+            alu(registers, d->kk, d->y, d->n);
+            pc = (pc + 2) & CHIP8_ADDRESS_MASK;
+            NEXT();
+
+        HANDLER(OP_JP_IDLE)
+            pc = d->nnn;
+            IDLE();
+            NEXT();
+    }
+#ifdef __GNUC__
+done:
+#endif
+    vm->pc = pc;
+}
+
+#undef DEBUG
+#undef NIBBLE
+#undef MAX_FUSED
+#undef HANDLER
+#undef REDISPATCH
+#undef NEXT
+#undef LEFT
+#undef SINGLE
+#undef IDLE
@@ -0,0 +1,73 @@
+#ifndef PREDECODE_H
+#define PREDECODE_H
+
+#include <stdint.h>
+
+struct chip8_vm;
+
+//Handler index of a decoded instruction
+enum chip8_op {
+    //Not decoded yet, decoded on first execution
+    OP_DECODE,
+    OP_UNKNOWN,
+    OP_CLS,         //00E0
+    OP_RET,         //00EE
+    OP_JP,          //1nnn
+    OP_CALL,        //2nnn
+    OP_SE_IMM,      //3xkk
+    OP_SNE_IMM,     //4xkk
+    OP_SE_REG,      //5xy0
+    OP_LD_IMM,      //6xkk
+    OP_ADD_IMM,     //7xkk
+    OP_LD_REG,      //8xy0
+    OP_OR,          //8xy1
+    OP_AND,         //8xy2
+    OP_XOR,         //8xy3
+    OP_ADD_REG,     //8xy4
+    OP_SUB,         //8xy5
+    OP_SHR,         //8xy6
+    OP_SUBN,        //8xy7
+    OP_SHL,         //8xyE
+    OP_SNE_REG,     //9xy0
+    OP_LD_I,        //Annn
+    OP_JP_V0,       //Bnnn
+    OP_RND,         //Cxkk
+    OP_DRW,         //Dxyn
+    OP_SKP,         //Ex9E
+    OP_SKNP,        //ExA1
+    OP_LD_VX_DT,    //Fx07
+    OP_LD_KEY,      //Fx0A
+    OP_LD_DT,       //Fx15
+    OP_LD_ST,       //Fx18
+    OP_ADD_I,       //Fx1E
+    OP_LD_FONT,     //Fx29
+    OP_BCD,         //Fx33
+    OP_STORE,       //Fx55
+    OP_LOAD,        //Fx65
+    NUM_OPS,
+    //Common sequences run by one handler, only ever found in the decode cache
+    OP_LD_I_DRW = NUM_OPS,  //Annn Dxyn
+    OP_LD_IMM2,             //6xkk 6ykk, the second byte in n
+    OP_ADD_SE_JP,           //7xkk 3yKK 1nnn, KK in n
+    OP_ADD_SNE_JP,          //7xkk 4yKK 1nnn, KK in n
+    OP_LOAD_ALU,            //Fx65 8yzN, y and z in y and n, the 8xyN handler index in kk
+    OP_JP_IDLE,             //1nnn to itself or two instructions back, where loops wait for the next frame
+    NUM_HANDLERS
+};
+
+//Instruction decoded once into a handler index and its operands
+struct chip8_decoded {
+    uint8_t op;
+    uint8_t x;
+    uint8_t y;
+    uint8_t kk;
+    uint16_t nnn;
+    uint8_t n;
+};
+
+void chip8_decode(uint16_t instruction, struct chip8_decoded* d);
+struct chip8_decoded* predecode_create(void);
+void predecode_invalidate(struct chip8_decoded* decoded, uint16_t address, uint16_t length);
+void predecode_run(struct chip8_vm* vm, uint64_t count);
+
+#endif
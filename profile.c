@@ -0,0 +1,424 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "chip8.h"
+#include "disasm.h"
+#include "predecode.h"
+#include "profile.h"
+
+#define NO_NODE -1
+#define INITIAL_NODES 64
+#define MAX_DEPTH 16
+#define HOT_BLOCKS 10
+
+//Call path, one per distinct chain of return addresses on the stack
+struct profile_node {
+    //Return address pushed by the call, the root has none
+    uint16_t return_address;
+    //Subroutine entered, read from the 2nnn when the node was created
+    uint16_t target;
+    int parent;
+    int first_child;
+    int next_sibling;
+    //Instructions executed with exactly this call path
+    uint64_t self;
+};
+
+//Basic block found by profile_stop
+struct profile_block {
+    uint16_t start;
+    uint16_t end;
+    uint64_t entered;
+    uint64_t instructions;
+};
+
+/*
+    Execution counts of one run on the interpreter tier. Block boundaries come from the control flow
+    graph of the final memory and from every address that was reached by something other than falling through.
+*/
+struct chip8_profile {
+    uint64_t heat[CHIP8_MEMORY_SIZE];
+    //Set for addresses reached by a jump, call, return or taken skip
+    bool entered[CHIP8_MEMORY_SIZE];
+    uint16_t prev_pc;
+    uint64_t total;
+
+    struct profile_node* nodes;
+    int num_nodes;
+    int max_nodes;
+    //Node of the call path last seen and the stack it was found for
+    int current;
+    uint8_t current_depth;
+    uint16_t current_stack[MAX_DEPTH];
+
+    //Filled in by profile_stop
+    uint8_t memory[CHIP8_MEMORY_SIZE];
+    bool reachable[CHIP8_MEMORY_SIZE];
+    bool leader[CHIP8_MEMORY_SIZE];
+};
+
+static int add_node(struct chip8_profile* profile, int parent, uint16_t return_address, uint16_t target) {
+    if(profile->num_nodes == profile->max_nodes) {
+        int max_nodes = profile->max_nodes ? profile->max_nodes * 2 : INITIAL_NODES;
+        struct profile_node* nodes = realloc(profile->nodes, sizeof(*nodes) * max_nodes);
+
+        if(!nodes) {
+            return NO_NODE;
+        }
+        profile->nodes = nodes;
+        profile->max_nodes = max_nodes;
+    }
+
+    struct profile_node* node = &profile->nodes[profile->num_nodes];
+    node->return_address = return_address;
+    node->target = target;
+    node->parent = parent;
+    node->first_child = NO_NODE;
+    node->next_sibling = NO_NODE;
+    node->self = 0;
+
+    if(parent != NO_NODE) {
+        node->next_sibling = profile->nodes[parent].first_child;
+        profile->nodes[parent].first_child = profile->num_nodes;
+    }
+
+    return profile->num_nodes++;
+}
+
+/*
+    @returns Empty profile, NULL if out of memory
+*/
+struct chip8_profile* profile_create(void) {
+    struct chip8_profile* profile = calloc(1, sizeof(*profile));
+
+    if(profile && add_node(profile, NO_NODE, 0, 0) == NO_NODE) {
+        free(profile);
+        return NULL;
+    }
+
+    return profile;
+}
+
+void profile_destroy(struct chip8_profile* profile) {
+    if(profile) {
+        free(profile->nodes);
+        free(profile);
+    }
+}
+
+/*
+    Starts counting the instructions of a machine, which is switched to the interpreter tier
+*/
+void profile_start(struct chip8_profile* profile, struct chip8_vm* vm) {
+    profile->prev_pc = vm->pc & CHIP8_ADDRESS_MASK;
+    profile->entered[profile->prev_pc] = true;
+    profile->current = 0;
+    profile->current_depth = 0;
+    //Only the interpreter stops at every instruction
+    chip8_set_tier(vm, CHIP8_TIER_INTERPRETER);
+    vm->profile = profile;
+}
+
+/*
+    Finds the call path of the machine's stack, creating nodes for paths not seen before
+*/
+static int find_node(struct chip8_profile* profile, const struct chip8_vm* vm, uint8_t depth) {
+    int node = 0;
+    int i = 0;
+
+    for(;i < depth && node != NO_NODE;i++) {
+        uint16_t return_address = vm->stack[i] & CHIP8_ADDRESS_MASK;
+        int child = profile->nodes[node].first_child;
+
+        while(child != NO_NODE && profile->nodes[child].return_address != return_address) {
+            child = profile->nodes[child].next_sibling;
+        }
+
+        if(child == NO_NODE) {
+            uint16_t call = (return_address - 2) & CHIP8_ADDRESS_MASK;
+            uint16_t target = chip8_instruction_at(vm, call) & 0xFFF;
+            child = add_node(profile, node, return_address, target);
+        }
+        node = child;
+    }
+
+    return node;
+}
+
+/*
+    Counts the instruction at vm->pc, called by the interpreter before it executes
+*/
+void profile_instruction(struct chip8_profile* profile, const struct chip8_vm* vm) {
+    uint16_t pc = vm->pc & CHIP8_ADDRESS_MASK;
+    uint8_t depth = vm->stack_ptr < MAX_DEPTH ? vm->stack_ptr : MAX_DEPTH;
+
+    //Instructions that wait by running again, Fx0A and Dxyn, do not start a block
+    if(pc != profile->prev_pc && pc != ((profile->prev_pc + 2) & CHIP8_ADDRESS_MASK)) {
+        profile->entered[pc] = true;
+    }
+    profile->prev_pc = pc;
+    profile->heat[pc]++;
+    profile->total++;
+
+    //Calls and returns are rare next to other instructions, the path is only looked up when the stack changed
+    if(depth != profile->current_depth || (depth && vm->stack[depth - 1] != profile->current_stack[depth - 1])) {
+        int node = find_node(profile, vm, depth);
+
+        profile->current = node != NO_NODE ? node : 0;
+        profile->current_depth = depth;
+        memcpy(profile->current_stack, vm->stack, sizeof(uint16_t) * depth);
+    }
+    profile->nodes[profile->current].self++;
+}
+
+static uint16_t instruction_at(const struct chip8_profile* profile, uint16_t address) {
+    return profile->memory[address] << 8 | profile->memory[(address + 1) & CHIP8_ADDRESS_MASK];
+}
+
+static bool ends_block(uint8_t op) {
+    return op == OP_JP || op == OP_CALL || op == OP_RET || op == OP_JP_V0 || op == OP_SE_IMM ||
+        op == OP_SNE_IMM || op == OP_SE_REG || op == OP_SNE_REG || op == OP_SKP || op == OP_SKNP;
+}
+
+/*
+    Marks every instruction reachable from start, and the block leaders among them
+*/
+static void trace(struct chip8_profile* profile, uint16_t start) {
+    uint16_t* pending = malloc(sizeof(uint16_t) * CHIP8_MEMORY_SIZE * 2);
+    int count = 0;
+
+    if(!pending) {
+        return;
+    }
+
+    profile->leader[start] = true;
+    pending[count++] = start;
+
+    while(count) {
+        uint16_t pc = pending[--count];
+        uint16_t next[2];
+        int num_next = 0;
+        struct chip8_decoded d;
+
+        if(profile->reachable[pc]) {
+            continue;
+        }
+        profile->reachable[pc] = true;
+        chip8_decode(instruction_at(profile, pc), &d);
+
+        switch(d.op) {
+            case OP_JP:
+                next[num_next++] = d.nnn;
+                break;
+            case OP_CALL:
+                next[num_next++] = d.nnn;
+                next[num_next++] = (pc + 2) & CHIP8_ADDRESS_MASK;
+                break;
+            case OP_SE_IMM: case OP_SNE_IMM: case OP_SE_REG: case OP_SNE_REG: case OP_SKP: case OP_SKNP:
+                next[num_next++] = (pc + 2) & CHIP8_ADDRESS_MASK;
+                next[num_next++] = (pc + 4) & CHIP8_ADDRESS_MASK;
+                break;
+            //Targets of returns and Bnnn are only known from the run
+            case OP_RET: case OP_JP_V0:
+                break;
+            default:
+                next[num_next++] = (pc + 2) & CHIP8_ADDRESS_MASK;
+                break;
+        }
+
+        int i = 0;
+        for(;i < num_next;i++) {
+            if(ends_block(d.op)) {
+                profile->leader[next[i]] = true;
+            }
+            if(!profile->reachable[next[i]] && count < CHIP8_MEMORY_SIZE * 2) {
+                pending[count++] = next[i];
+            }
+        }
+    }
+
+    free(pending);
+}
+
+/*
+    Stops counting and builds the control flow graph from the machine's memory
+*/
+void profile_stop(struct chip8_profile* profile, struct chip8_vm* vm) {
+    int i = 0;
+
+    vm->profile = NULL;
+    chip8_copy_memory(vm, profile->memory);
+    memset(profile->reachable, 0, sizeof(profile->reachable));
+    memset(profile->leader, 0, sizeof(profile->leader));
+
+    //Everything that ran is a root too, which covers Bnnn targets and code written at run time
+    trace(profile, 0x200);
+    for(;i < CHIP8_MEMORY_SIZE;i++) {
+        if(profile->entered[i]) {
+            trace(profile, i);
+        }
+    }
+}
+
+/*
+    Splits the reachable instructions into blocks
+    @returns Number of blocks, blocks must have room for CHIP8_MEMORY_SIZE
+*/
+static int find_blocks(const struct chip8_profile* profile, struct profile_block* blocks) {
+    int count = 0;
+    int i = 0;
+
+    while(i < CHIP8_MEMORY_SIZE) {
+        if(!profile->reachable[i]) {
+            i++;
+            continue;
+        }
+
+        struct profile_block* block = &blocks[count++];
+        struct chip8_decoded d;
+        block->start = i;
+        block->entered = profile->heat[i];
+        block->instructions = 0;
+
+        //A block runs until it branches or falls into another block
+        do {
+            block->end = i;
+            block->instructions += profile->heat[i];
+            chip8_decode(instruction_at(profile, i), &d);
+            i += 2;
+        } while(i < CHIP8_MEMORY_SIZE && !ends_block(d.op) && profile->reachable[i] && !profile->leader[i]);
+    }
+
+    return count;
+}
+
+static void write_successors(FILE* file, const struct chip8_profile* profile, uint16_t end) {
+    struct chip8_decoded d;
+
+    chip8_decode(instruction_at(profile, end), &d);
+    switch(d.op) {
+        case OP_JP:
+            fprintf(file, " -> 0x%03X", d.nnn);
+            break;
+        case OP_CALL:
+            fprintf(file, " -> call 0x%03X, 0x%03X", d.nnn, (end + 2) & CHIP8_ADDRESS_MASK);
+            break;
+        case OP_RET:
+            fprintf(file, " -> return");
+            break;
+        case OP_JP_V0:
+            fprintf(file, " -> V0 + 0x%03X", d.nnn);
+            break;
+        case OP_SE_IMM: case OP_SNE_IMM: case OP_SE_REG: case OP_SNE_REG: case OP_SKP: case OP_SKNP:
+            fprintf(file, " -> 0x%03X, 0x%03X", (end + 2) & CHIP8_ADDRESS_MASK, (end + 4) & CHIP8_ADDRESS_MASK);
+            break;
+        default:
+            fprintf(file, " -> 0x%03X", (end + 2) & CHIP8_ADDRESS_MASK);
+            break;
+    }
+}
+
+static double percent(const struct chip8_profile* profile, uint64_t count) {
+    return profile->total ? 100.0 * count / profile->total : 0;
+}
+
+/*
+    Writes every reachable instruction grouped into blocks, with execution counts, and the hottest blocks first
+    @returns False if the file couldn't be written
+*/
+bool profile_write_disassembly(const struct chip8_profile* profile, const char* filepath) {
+    struct profile_block* blocks = malloc(sizeof(*blocks) * CHIP8_MEMORY_SIZE);
+    FILE* file = fopen(filepath, "w");
+    char text[32];
+
+    if(!blocks || !file) {
+        free(blocks);
+        if(file) {
+            fclose(file);
+        }
+        return false;
+    }
+
+    int count = find_blocks(profile, blocks);
+    fprintf(file, "; %llu instructions in %d blocks\n; hottest blocks:\n", (unsigned long long) profile->total, count);
+
+    //Selection of the few hottest, the list is short
+    bool* listed = calloc(count ? count : 1, sizeof(bool));
+    int i = 0;
+    for(;listed && i < HOT_BLOCKS && i < count;i++) {
+        int best = -1;
+        int j = 0;
+        for(;j < count;j++) {
+            if(!listed[j] && (best < 0 || blocks[j].instructions > blocks[best].instructions)) {
+                best = j;
+            }
+        }
+        if(!blocks[best].instructions) {
+            break;
+        }
+        listed[best] = true;
+        fprintf(file, ";   0x%03X-0x%03X %12llu %5.1f%%\n", blocks[best].start, blocks[best].end,
+            (unsigned long long) blocks[best].instructions, percent(profile, blocks[best].instructions));
+    }
+    free(listed);
+
+    for(i = 0;i < count;i++) {
+        fprintf(file, "\n; block 0x%03X-0x%03X entered %llu, %llu instructions (%.1f%%)", blocks[i].start, blocks[i].end,
+            (unsigned long long) blocks[i].entered, (unsigned long long) blocks[i].instructions, percent(profile, blocks[i].instructions));
+        write_successors(file, profile, blocks[i].end);
+        fprintf(file, "\n");
+
+        uint16_t pc = blocks[i].start;
+        for(;pc <= blocks[i].end;pc += 2) {
+            uint16_t instruction = instruction_at(profile, pc);
+
+            chip8_disassemble(instruction, text, sizeof(text));
+            fprintf(file, "0x%03X  %04X  %-16s %12llu %5.1f%%\n", pc, instruction, text,
+                (unsigned long long) profile->heat[pc], percent(profile, profile->heat[pc]));
+        }
+    }
+
+    free(blocks);
+    return !fclose(file);
+}
+
+/*
+    Writes "main;sub_2A0;sub_300 count" lines, one per call path, for flame graph tools
+    @returns False if the file couldn't be written
+*/
+bool profile_write_folded(const struct chip8_profile* profile, const char* filepath) {
+    FILE* file = fopen(filepath, "w");
+    int path[MAX_DEPTH + 1];
+    int i = 0;
+
+    if(!file) {
+        return false;
+    }
+
+    for(;i < profile->num_nodes;i++) {
+        int depth = 0;
+        int node = i;
+
+        if(!profile->nodes[i].self) {
+            continue;
+        }
+
+        for(;node != NO_NODE && depth <= MAX_DEPTH;node = profile->nodes[node].parent) {
+            path[depth++] = node;
+        }
+
+        fprintf(file, "main");
+        while(--depth > 0) {
+            fprintf(file, ";sub_%03X", profile->nodes[path[depth - 1]].target);
+        }
+        fprintf(file, " %llu\n", (unsigned long long) profile->nodes[i].self);
+    }
+
+    return !fclose(file);
+}
+
+#undef NO_NODE
+#undef INITIAL_NODES
+#undef MAX_DEPTH
+#undef HOT_BLOCKS
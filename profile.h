@@ -0,0 +1,17 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include <stdbool.h>
+
+struct chip8_vm;
+struct chip8_profile;
+
+struct chip8_profile* profile_create(void);
+void profile_destroy(struct chip8_profile* profile);
+void profile_start(struct chip8_profile* profile, struct chip8_vm* vm);
+void profile_instruction(struct chip8_profile* profile, const struct chip8_vm* vm);
+void profile_stop(struct chip8_profile* profile, struct chip8_vm* vm);
+bool profile_write_disassembly(const struct chip8_profile* profile, const char* filepath);
+bool profile_write_folded(const struct chip8_profile* profile, const char* filepath);
+
+#endif
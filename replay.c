@@ -0,0 +1,172 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "chip8.h"
+#include "replay.h"
+
+#define DEBUG 0
+#define INITIAL_CAPACITY 256
+
+//Layout of the file header, followed by count input_event records
+struct input_log_header {
+    uint32_t magic;
+    uint16_t version;
+    uint8_t display_wait;
+    uint8_t reserved;
+    uint64_t rng;
+    uint64_t frames;
+    uint64_t cycles;
+    uint32_t cycles_per_frame;
+    uint32_t count;
+};
+
+/*
+    @returns Empty log, NULL if out of memory
+*/
+struct chip8_input_log* input_log_create(void) {
+    return calloc(1, sizeof(struct chip8_input_log));
+}
+
+void input_log_destroy(struct chip8_input_log* log) {
+    if(log) {
+        free(log->events);
+        free(log);
+    }
+}
+
+/*
+    Starts recording a machine that was just loaded, before its first frame
+*/
+void input_log_start(struct chip8_input_log* log, struct chip8_vm* vm) {
+    log->rng = vm->rng;
+    log->cycles_per_frame = vm->cycles_per_frame;
+    log->display_wait = vm->display_wait;
+    log->frames = 0;
+    log->cycles = 0;
+    log->count = 0;
+    vm->recording = log;
+}
+
+/*
+    Stores the keyboard if the held keys changed since the last event or a key was released this frame,
+    called by chip8_run after the backend handled events
+*/
+void input_log_capture(struct chip8_input_log* log, const struct chip8_vm* vm) {
+    uint16_t keypad = atomic_load_explicit(&vm->keypad, memory_order_relaxed);
+    uint16_t last = log->count ? log->events[log->count - 1].keypad : 0;
+
+    //Releases only last one frame, so the same key released on two frames in a row is two events
+    if(last == keypad && vm->key_up == CHIP8_NO_KEY) {
+        return;
+    }
+
+    if(log->count == log->capacity) {
+        uint32_t capacity = log->capacity ? log->capacity * 2 : INITIAL_CAPACITY;
+        struct input_event* events = realloc(log->events, sizeof(*events) * capacity);
+
+        if(!events) {
+            if(DEBUG) {
+                printf("Input log out of memory at frame %llu\n", (unsigned long long) vm->frames);
+            }
+            return;
+        }
+        log->events = events;
+        log->capacity = capacity;
+    }
+
+    struct input_event* e = &log->events[log->count++];
+    e->frame = vm->frames;
+    e->keypad = keypad;
+    e->key_up = vm->key_up;
+    e->reserved = 0;
+}
+
+/*
+    Ends the recording, the log now covers every frame the machine ran
+*/
+void input_log_stop(struct chip8_input_log* log, struct chip8_vm* vm) {
+    log->frames = vm->frames;
+    log->cycles = vm->cycles;
+    vm->recording = NULL;
+}
+
+/*
+    @returns False if the file couldn't be written
+*/
+bool input_log_write(const struct chip8_input_log* log, const char* filepath) {
+    struct input_log_header header = {CHIP8_INPUT_LOG_MAGIC, CHIP8_INPUT_LOG_VERSION, log->display_wait, 0,
+        log->rng, log->frames, log->cycles, log->cycles_per_frame, log->count};
+    FILE* file = fopen(filepath, "wb");
+
+    if(!file) {
+        return false;
+    }
+
+    bool ok = fwrite(&header, sizeof(header), 1, file) == 1 &&
+        fwrite(log->events, sizeof(struct input_event), log->count, file) == log->count;
+    return !fclose(file) && ok;
+}
+
+/*
+    @returns Log written by input_log_write, NULL if the file is missing, truncated or from another version
+*/
+struct chip8_input_log* input_log_read(const char* filepath) {
+    struct input_log_header header;
+    struct chip8_input_log* log = NULL;
+    FILE* file = fopen(filepath, "rb");
+
+    if(!file) {
+        return NULL;
+    }
+
+    if(fread(&header, sizeof(header), 1, file) == 1 && header.magic == CHIP8_INPUT_LOG_MAGIC &&
+        header.version == CHIP8_INPUT_LOG_VERSION && (log = input_log_create())) {
+        log->rng = header.rng;
+        log->frames = header.frames;
+        log->cycles = header.cycles;
+        log->cycles_per_frame = header.cycles_per_frame;
+        log->display_wait = header.display_wait;
+        log->count = log->capacity = header.count;
+
+        if(header.count && (!(log->events = malloc(sizeof(struct input_event) * header.count)) ||
+            fread(log->events, sizeof(struct input_event), header.count, file) != header.count)) {
+            input_log_destroy(log);
+            log = NULL;
+        }
+    }
+
+    fclose(file);
+    return log;
+}
+
+/*
+    Repeats a recorded session on a machine that was just loaded with the same ROM, up to the
+    instruction it stopped on. Runs frames back to back without the backend, so it is as fast as the execution tier.
+    The backend is only asked to draw once at the end.
+*/
+void input_log_replay(const struct chip8_input_log* log, struct chip8_vm* vm) {
+    uint32_t next = 0;
+
+    vm->rng = log->rng;
+    vm->cycles_per_frame = log->cycles_per_frame;
+    vm->display_wait = log->display_wait;
+    //The session may have stopped part way through its last frame
+    vm->cycle_limit = log->cycles;
+
+    while(vm->cycles < log->cycles) {
+        //Like a backend, no key is released on a frame without an event
+        vm->key_up = CHIP8_NO_KEY;
+        for(;next < log->count && log->events[next].frame <= vm->frames;next++) {
+            atomic_store_explicit(&vm->keypad, log->events[next].keypad, memory_order_relaxed);
+            vm->key_up = log->events[next].key_up;
+        }
+
+        chip8_run_frame(vm);
+    }
+
+    vm->io->draw(vm);
+}
+
+#undef DEBUG
+#undef INITIAL_CAPACITY
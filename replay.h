@@ -0,0 +1,48 @@
+#ifndef REPLAY_H
+#define REPLAY_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+struct chip8_vm;
+
+//"C8IN" read as a little endian word
+#define CHIP8_INPUT_LOG_MAGIC 0x4E493843
+#define CHIP8_INPUT_LOG_VERSION 2
+
+//Keyboard state the backend left at the start of a frame, stored when the held keys changed or a key was released
+struct input_event {
+    uint32_t frame;
+    //Bit per key held down
+    uint16_t keypad;
+    uint8_t key_up;
+    uint8_t reserved;
+};
+
+/*
+    Everything needed to repeat a session from power on: the generator state,
+    the pacing that decides which instruction each frame ends on, and the keyboard changes
+*/
+struct chip8_input_log {
+    uint64_t rng;
+    uint32_t cycles_per_frame;
+    bool display_wait;
+    //Frames and instructions the session ran for, it may end part way through its last frame
+    uint64_t frames;
+    uint64_t cycles;
+
+    struct input_event* events;
+    uint32_t count;
+    uint32_t capacity;
+};
+
+struct chip8_input_log* input_log_create(void);
+void input_log_destroy(struct chip8_input_log* log);
+void input_log_start(struct chip8_input_log* log, struct chip8_vm* vm);
+void input_log_capture(struct chip8_input_log* log, const struct chip8_vm* vm);
+void input_log_stop(struct chip8_input_log* log, struct chip8_vm* vm);
+bool input_log_write(const struct chip8_input_log* log, const char* filepath);
+struct chip8_input_log* input_log_read(const char* filepath);
+void input_log_replay(const struct chip8_input_log* log, struct chip8_vm* vm);
+
+#endif
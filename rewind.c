@@ -0,0 +1,282 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "chip8.h"
+#include "rewind.h"
+#include "savestate.h"
+
+//Save states are compared one word at a time
+#define WORD_SIZE 8
+#define STATE_WORDS (sizeof(struct chip8_savestate) / WORD_SIZE)
+//Every delta run starts with its byte offset and length
+#define RUN_HEADER 4
+
+_Static_assert(sizeof(struct chip8_savestate) % WORD_SIZE == 0, "save state must be whole words");
+
+//One recorded frame, stored in the arena
+struct rewind_entry {
+    size_t start;
+    size_t size;
+    //Full save state, otherwise runs of bytes that differ from the last keyframe before it
+    bool keyframe;
+};
+
+/*
+    Ring of per frame snapshots. Keyframes hold a whole save state, the frames between them hold
+    only the runs of bytes that differ from their keyframe, so stepping back one frame is one
+    keyframe copy plus one small patch. Entries are packed into a circular byte arena and the
+    oldest ones are dropped when it fills up.
+*/
+struct chip8_rewind {
+    uint8_t* arena;
+    size_t arena_size;
+    //Where the next entry is written
+    size_t head;
+
+    struct rewind_entry* entries;
+    int max_entries;
+    //Oldest entry and number of entries
+    int first;
+    int count;
+
+    int keyframe_interval;
+    //Frames recorded since the last keyframe, a keyframe is written when it reaches the interval
+    int since_keyframe;
+    //Entry index of the keyframe in key, -1 if key must not be used
+    int key_index;
+    struct chip8_savestate key;
+    //Snapshot being recorded or restored
+    struct chip8_savestate scratch;
+};
+
+/*
+    @param arena_size Bytes available for snapshots
+    @param max_frames Most frames kept
+    @param keyframe_interval Frames between full snapshots
+    @returns NULL if out of memory
+*/
+struct chip8_rewind* rewind_create(size_t arena_size, int max_frames, int keyframe_interval) {
+    struct chip8_rewind* rewind = calloc(1, sizeof(*rewind));
+
+    if(!rewind) {
+        return NULL;
+    }
+
+    rewind->arena = malloc(arena_size);
+    rewind->entries = malloc(sizeof(struct rewind_entry) * (max_frames > 0 ? max_frames : 1));
+    if(!rewind->arena || !rewind->entries) {
+        rewind_destroy(rewind);
+        return NULL;
+    }
+
+    rewind->arena_size = arena_size;
+    rewind->max_entries = max_frames > 0 ? max_frames : 1;
+    rewind->keyframe_interval = keyframe_interval > 0 ? keyframe_interval : 1;
+    rewind_clear(rewind);
+    return rewind;
+}
+
+void rewind_destroy(struct chip8_rewind* rewind) {
+    if(rewind) {
+        free(rewind->arena);
+        free(rewind->entries);
+        free(rewind);
+    }
+}
+
+/*
+    Drops every recorded frame
+*/
+void rewind_clear(struct chip8_rewind* rewind) {
+    rewind->head = 0;
+    rewind->first = 0;
+    rewind->count = 0;
+    rewind->key_index = -1;
+}
+
+/*
+    Number of frames that can be stepped back
+*/
+int rewind_frames(const struct chip8_rewind* rewind) {
+    return rewind->count > 0 ? rewind->count - 1 : 0;
+}
+
+static struct rewind_entry* entry_at(struct chip8_rewind* rewind, int index) {
+    return &rewind->entries[index % rewind->max_entries];
+}
+
+/*
+    Drops the oldest entry and every delta that depended on it
+*/
+static void drop_oldest(struct chip8_rewind* rewind) {
+    do {
+        if(rewind->key_index == rewind->first) {
+            rewind->key_index = -1;
+        }
+        rewind->first = (rewind->first + 1) % rewind->max_entries;
+        rewind->count--;
+    } while(rewind->count && !entry_at(rewind, rewind->first)->keyframe);
+}
+
+/*
+    Finds arena space for size bytes, evicting the oldest entries it overlaps
+    @returns Offset into the arena
+*/
+static size_t reserve(struct chip8_rewind* rewind, size_t size) {
+    size_t start = rewind->head;
+
+    if(rewind->count == rewind->max_entries) {
+        drop_oldest(rewind);
+    }
+
+    //Entries never wrap, the unused tail of the arena is skipped along with what was stored there
+    if(start + size > rewind->arena_size) {
+        while(rewind->count && entry_at(rewind, rewind->first)->start >= start) {
+            drop_oldest(rewind);
+        }
+        start = 0;
+    }
+
+    while(rewind->count && entry_at(rewind, rewind->first)->start >= start &&
+        entry_at(rewind, rewind->first)->start < start + size) {
+        drop_oldest(rewind);
+    }
+
+    return start;
+}
+
+/*
+    Writes the runs of words where state differs from key as (offset, length, bytes)
+    @param out Has room for a whole save state plus headers, or NULL to only measure
+    @returns Bytes written
+*/
+static size_t encode_delta(const struct chip8_savestate* key, const struct chip8_savestate* state, uint8_t* out) {
+    const uint64_t* a = (const uint64_t*) key;
+    const uint64_t* b = (const uint64_t*) state;
+    size_t size = 0;
+    size_t i = 0;
+
+    while(i < STATE_WORDS) {
+        if(a[i] == b[i]) {
+            i++;
+            continue;
+        }
+
+        size_t run = i;
+        while(i < STATE_WORDS && a[i] != b[i]) {
+            i++;
+        }
+
+        uint16_t offset = run * WORD_SIZE;
+        uint16_t length = (i - run) * WORD_SIZE;
+        if(out) {
+            memcpy(out + size, &offset, 2);
+            memcpy(out + size + 2, &length, 2);
+            memcpy(out + size + RUN_HEADER, (const uint8_t*) state + offset, length);
+        }
+        size += RUN_HEADER + length;
+    }
+
+    return size;
+}
+
+static void apply_delta(struct chip8_savestate* state, const uint8_t* delta, size_t size) {
+    size_t pos = 0;
+
+    while(pos < size) {
+        uint16_t offset;
+        uint16_t length;
+
+        memcpy(&offset, delta + pos, 2);
+        memcpy(&length, delta + pos + 2, 2);
+        memcpy((uint8_t*) state + offset, delta + pos + RUN_HEADER, length);
+        pos += RUN_HEADER + length;
+    }
+}
+
+/*
+    Records the machine state, call once per frame
+    @returns False if the arena is too small for a single keyframe
+*/
+bool rewind_record(struct chip8_rewind* rewind, const struct chip8_vm* vm) {
+    chip8_save_state(vm, &rewind->scratch);
+
+    bool keyframe = rewind->key_index < 0 || rewind->since_keyframe >= rewind->keyframe_interval;
+    size_t size = keyframe ? sizeof(rewind->scratch) : encode_delta(&rewind->key, &rewind->scratch, NULL);
+
+    if(size > rewind->arena_size) {
+        return false;
+    }
+
+    size_t start = reserve(rewind, size);
+    //Eviction may have dropped the keyframe this delta was measured against
+    if(!keyframe && rewind->key_index < 0) {
+        keyframe = true;
+        size = sizeof(rewind->scratch);
+        start = reserve(rewind, size);
+    }
+
+    int index = (rewind->first + rewind->count) % rewind->max_entries;
+    struct rewind_entry* entry = &rewind->entries[index];
+    entry->start = start;
+    entry->size = size;
+    entry->keyframe = keyframe;
+    rewind->count++;
+    rewind->head = start + size;
+
+    if(keyframe) {
+        memcpy(rewind->arena + start, &rewind->scratch, size);
+        memcpy(&rewind->key, &rewind->scratch, size);
+        rewind->key_index = index;
+        rewind->since_keyframe = 1;
+    }
+    else {
+        encode_delta(&rewind->key, &rewind->scratch, rewind->arena + start);
+        rewind->since_keyframe++;
+    }
+
+    return true;
+}
+
+/*
+    Drops the newest frame and puts the machine back into the one recorded before it
+    @returns False if there is no earlier frame
+*/
+bool rewind_step_back(struct chip8_rewind* rewind, struct chip8_vm* vm) {
+    if(rewind->count < 2) {
+        return false;
+    }
+
+    int newest = (rewind->first + rewind->count - 1) % rewind->max_entries;
+    rewind->head = rewind->entries[newest].start;
+    if(rewind->key_index == newest) {
+        rewind->key_index = -1;
+    }
+    rewind->count--;
+    newest = (newest + rewind->max_entries - 1) % rewind->max_entries;
+
+    //Finds the keyframe the frame was recorded against
+    int key = newest;
+    int distance = 1;
+    while(!rewind->entries[key].keyframe) {
+        key = (key + rewind->max_entries - 1) % rewind->max_entries;
+        distance++;
+    }
+
+    if(rewind->key_index != key) {
+        memcpy(&rewind->key, rewind->arena + rewind->entries[key].start, sizeof(rewind->key));
+        rewind->key_index = key;
+    }
+    rewind->since_keyframe = distance;
+
+    memcpy(&rewind->scratch, &rewind->key, sizeof(rewind->scratch));
+    if(key != newest) {
+        apply_delta(&rewind->scratch, rewind->arena + rewind->entries[newest].start, rewind->entries[newest].size);
+    }
+
+    return chip8_restore_state(vm, &rewind->scratch);
+}
+
+#undef WORD_SIZE
+#undef STATE_WORDS
+#undef RUN_HEADER
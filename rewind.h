@@ -0,0 +1,18 @@
+#ifndef REWIND_H
+#define REWIND_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+struct chip8_vm;
+struct chip8_rewind;
+
+struct chip8_rewind* rewind_create(size_t arena_size, int max_frames, int keyframe_interval);
+void rewind_destroy(struct chip8_rewind* rewind);
+void rewind_clear(struct chip8_rewind* rewind);
+bool rewind_record(struct chip8_rewind* rewind, const struct chip8_vm* vm);
+bool rewind_step_back(struct chip8_rewind* rewind, struct chip8_vm* vm);
+int rewind_frames(const struct chip8_rewind* rewind);
+
+#endif
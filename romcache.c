@@ -0,0 +1,190 @@
+#define _POSIX_C_SOURCE 200809L
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "chip8.h"
+#include "romcache.h"
+
+#define DEBUG 0
+#define FNV_OFFSET 0xCBF29CE484222325ULL
+#define FNV_PRIME 0x100000001B3ULL
+
+#ifdef __APPLE__
+#define st_mtim st_mtimespec
+#endif
+
+//Cached image, found by content hash or by the file it was last read from
+struct cache_entry {
+    struct chip8_rom rom;
+    struct cache_entry* next;
+};
+
+//File already read, valid while it is the same file with the same size and modification time
+struct cache_path {
+    char* filepath;
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    struct timespec mtime;
+    //Wall clock second the file was read in, a write later in that second may keep the same mtime
+    time_t read_at;
+    const struct chip8_rom* rom;
+    struct cache_path* next;
+};
+
+//Process wide, lookups and inserts hold the lock, images are never changed once inserted
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static struct cache_entry* entries = NULL;
+static struct cache_path* paths = NULL;
+
+static uint64_t hash_rom(const uint8_t* rom, size_t size) {
+    uint64_t hash = FNV_OFFSET;
+    size_t i = 0;
+
+    for(;i < size;i++) {
+        hash = (hash ^ rom[i]) * FNV_PRIME;
+    }
+
+    return hash;
+}
+
+/*
+    Finds or adds the image of a ROM, the lock must be held
+*/
+static const struct chip8_rom* insert_locked(const uint8_t* rom, size_t size) {
+    uint64_t hash = hash_rom(rom, size);
+    struct cache_entry* entry = entries;
+
+    for(;entry;entry = entry->next) {
+        if(entry->rom.hash == hash && entry->rom.size == size && !memcmp(entry->rom.image + CHIP8_ROM_ADDRESS, rom, size)) {
+            return &entry->rom;
+        }
+    }
+
+    if(!(entry = malloc(sizeof(*entry))) || !chip8_make_image(entry->rom.image, rom, size)) {
+        free(entry);
+        return NULL;
+    }
+
+    entry->rom.hash = hash;
+    entry->rom.size = size;
+    entry->next = entries;
+    entries = entry;
+    return &entry->rom;
+}
+
+/*
+    Gets the image of a ROM already in memory
+    @returns NULL if the ROM doesn't fit above 0x200 or out of memory
+*/
+const struct chip8_rom* rom_cache_insert(const uint8_t* rom, size_t size) {
+    pthread_mutex_lock(&lock);
+    const struct chip8_rom* result = insert_locked(rom, size);
+    pthread_mutex_unlock(&lock);
+    return result;
+}
+
+/*
+    Gets the image of a ROM file. The file is mapped and hashed on first use and again only when
+    it is replaced, its size or modification time changes, or it was modified in the second it was read.
+    @returns NULL if the file can't be read, is empty or doesn't fit above 0x200
+*/
+const struct chip8_rom* rom_cache_load(const char* filepath) {
+    const struct chip8_rom* rom = NULL;
+    struct cache_path* path;
+    struct stat info;
+    int fd = open(filepath, O_RDONLY);
+
+    if(fd < 0 || fstat(fd, &info)) {
+        if(fd >= 0) {
+            close(fd);
+        }
+        return NULL;
+    }
+
+    pthread_mutex_lock(&lock);
+
+    for(path = paths;path;path = path->next) {
+        if(!strcmp(path->filepath, filepath)) {
+            break;
+        }
+    }
+
+    if(path && path->dev == info.st_dev && path->ino == info.st_ino && path->size == info.st_size &&
+        path->mtime.tv_sec == info.st_mtim.tv_sec && path->mtime.tv_nsec == info.st_mtim.tv_nsec &&
+        info.st_mtim.tv_sec < path->read_at) {
+        rom = path->rom;
+    }
+    else if(info.st_size > 0 && info.st_size <= CHIP8_MEMORY_SIZE - CHIP8_ROM_ADDRESS) {
+        //One mapping instead of one read call per byte
+        void* data = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+        if(data != MAP_FAILED) {
+            rom = insert_locked(data, info.st_size);
+            munmap(data, info.st_size);
+        }
+
+        if(rom && !path && (path = calloc(1, sizeof(*path)))) {
+            if((path->filepath = strdup(filepath))) {
+                path->next = paths;
+                paths = path;
+            }
+            else {
+                free(path);
+                path = NULL;
+            }
+        }
+
+        if(rom && path) {
+            path->dev = info.st_dev;
+            path->ino = info.st_ino;
+            path->size = info.st_size;
+            path->mtime = info.st_mtim;
+            path->read_at = time(NULL);
+            path->rom = rom;
+        }
+    }
+    else if(DEBUG) {
+        printf("%s is %lld bytes, ROMs hold 1 to %d\n", filepath, (long long) info.st_size, CHIP8_MEMORY_SIZE - CHIP8_ROM_ADDRESS);
+    }
+
+    pthread_mutex_unlock(&lock);
+    close(fd);
+    return rom;
+}
+
+/*
+    Frees every cached image. No machine may be loading while this runs, or still share pages of a cached image.
+*/
+void rom_cache_clear(void) {
+    pthread_mutex_lock(&lock);
+
+    while(entries) {
+        struct cache_entry* next = entries->next;
+        free(entries);
+        entries = next;
+    }
+
+    while(paths) {
+        struct cache_path* next = paths->next;
+        free(paths->filepath);
+        free(paths);
+        paths = next;
+    }
+
+    pthread_mutex_unlock(&lock);
+}
+
+#undef DEBUG
+#undef FNV_OFFSET
+#undef FNV_PRIME
+#ifdef __APPLE__
+#undef st_mtim
+#endif
@@ -0,0 +1,21 @@
+#ifndef ROMCACHE_H
+#define ROMCACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "chip8.h"
+
+//Memory image of a ROM, shared by every machine that loads it
+struct chip8_rom {
+    //FNV-1a hash of the ROM bytes
+    uint64_t hash;
+    size_t size;
+    //Font at 0, ROM at 0x200, zeros elsewhere
+    uint8_t image[CHIP8_MEMORY_SIZE];
+};
+
+const struct chip8_rom* rom_cache_load(const char* filepath);
+const struct chip8_rom* rom_cache_insert(const uint8_t* rom, size_t size);
+void rom_cache_clear(void);
+
+#endif
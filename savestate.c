@@ -0,0 +1,122 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "chip8.h"
+#include "savestate.h"
+
+#define DEBUG 0
+//Memory is compared in chunks so unchanged code keeps its decodes and translated blocks
+#define RESTORE_CHUNK 64
+
+_Static_assert(sizeof(struct chip8_savestate) == 352 + CHIP8_MEMORY_SIZE, "save state layout changed");
+
+/*
+    Captures the machine state
+    @param state Filled in completely, including magic and version
+*/
+void chip8_save_state(const struct chip8_vm* vm, struct chip8_savestate* state) {
+    int i = 0;
+
+    state->magic = CHIP8_SAVESTATE_MAGIC;
+    state->version = CHIP8_SAVESTATE_VERSION;
+    state->pc = vm->pc & CHIP8_ADDRESS_MASK;
+    state->index_register = vm->index_register;
+    state->stack_ptr = vm->stack_ptr;
+    state->sound_timer = vm->sound_timer;
+    state->delay_timer = vm->delay_timer;
+    state->key_up = vm->key_up;
+    state->keyboard = atomic_load_explicit(&vm->keypad, memory_order_relaxed);
+    state->cycles = vm->cycles;
+    state->frames = vm->frames;
+    state->rng = vm->rng;
+    state->flags = vm->vblank ? CHIP8_STATE_VBLANK : 0;
+    memset(state->reserved, 0, sizeof(state->reserved));
+
+    for(;i < 16;i++) {
+        state->stack[i] = vm->stack[i] & CHIP8_ADDRESS_MASK;
+        state->registers[i] = vm->registers[i];
+    }
+
+    memcpy(state->display, vm->display, sizeof(state->display));
+    chip8_copy_memory(vm, state->memory);
+}
+
+/*
+    Puts the machine back into a saved state. Backend, tier and pacing are kept.
+    @returns False if the state has the wrong magic or version, the machine is left unchanged
+*/
+bool chip8_restore_state(struct chip8_vm* vm, const struct chip8_savestate* state) {
+    int i = 0;
+
+    if(state->magic != CHIP8_SAVESTATE_MAGIC || state->version != CHIP8_SAVESTATE_VERSION) {
+        if(DEBUG) {
+            printf("Save state %08x version %d not supported\n", state->magic, state->version);
+        }
+        return false;
+    }
+
+    vm->pc = state->pc & CHIP8_ADDRESS_MASK;
+    vm->index_register = state->index_register;
+    vm->stack_ptr = state->stack_ptr;
+    vm->sound_timer = state->sound_timer;
+    vm->delay_timer = state->delay_timer;
+    vm->key_up = state->key_up;
+    vm->cycles = state->cycles;
+    vm->frames = state->frames;
+    vm->rng = state->rng;
+    atomic_store_explicit(&vm->keypad, state->keyboard, memory_order_relaxed);
+    vm->vblank = state->flags & CHIP8_STATE_VBLANK;
+
+    for(;i < 16;i++) {
+        vm->stack[i] = state->stack[i] & CHIP8_ADDRESS_MASK;
+        vm->registers[i] = state->registers[i];
+    }
+
+    memcpy(vm->display, state->display, sizeof(vm->display));
+    vm->dirty_rows = 0xFFFFFFFF;
+
+    //Only chunks that differ are copied and invalidated
+    for(i = 0;i < CHIP8_MEMORY_SIZE;i += RESTORE_CHUNK) {
+        if(memcmp(vm->pages[i >> CHIP8_PAGE_SHIFT] + (i & (CHIP8_PAGE_SIZE - 1)), state->memory + i, RESTORE_CHUNK)) {
+            memcpy(chip8_writable(vm, i), state->memory + i, RESTORE_CHUNK);
+            chip8_memory_written(vm, i, RESTORE_CHUNK);
+        }
+    }
+
+    return true;
+}
+
+/*
+    Writes a save state to disk
+    @returns False if the file couldn't be written
+*/
+bool chip8_write_state(const struct chip8_savestate* state, const char* filepath) {
+    FILE* file = fopen(filepath, "wb");
+
+    if(!file) {
+        return false;
+    }
+
+    bool ok = fwrite(state, sizeof(*state), 1, file) == 1;
+    return !fclose(file) && ok;
+}
+
+/*
+    Reads a save state written by chip8_write_state
+    @returns False if the file is missing, truncated or from another version
+*/
+bool chip8_read_state(struct chip8_savestate* state, const char* filepath) {
+    FILE* file = fopen(filepath, "rb");
+
+    if(!file) {
+        return false;
+    }
+
+    bool ok = fread(state, sizeof(*state), 1, file) == 1;
+    fclose(file);
+
+    return ok && state->magic == CHIP8_SAVESTATE_MAGIC && state->version == CHIP8_SAVESTATE_VERSION;
+}
+
+#undef DEBUG
+#undef RESTORE_CHUNK
@@ -0,0 +1,50 @@
+#ifndef SAVESTATE_H
+#define SAVESTATE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "chip8.h"
+
+//"C8ST" read as a little endian word
+#define CHIP8_SAVESTATE_MAGIC 0x54533843
+#define CHIP8_SAVESTATE_VERSION 2
+
+/*
+    Snapshot of everything a running machine needs to continue. The layout is fixed,
+    every field sits at its natural alignment so there is no compiler padding,
+    and the version is bumped whenever it changes. Words are stored in host byte order.
+*/
+struct chip8_savestate {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t pc;
+    uint16_t index_register;
+    //12 bit offsets into memory
+    uint16_t stack[16];
+    uint8_t registers[16];
+    uint8_t stack_ptr;
+    uint8_t sound_timer;
+    uint8_t delay_timer;
+    uint8_t key_up;
+    //Bit per key held down
+    uint16_t keyboard;
+    //Packed framebuffer, one word per row with x = 0 in the top bit
+    uint64_t display[CHIP8_HEIGHT];
+    uint64_t cycles;
+    uint64_t frames;
+    //Cxkk generator
+    uint64_t rng;
+    //CHIP8_STATE_* bits
+    uint8_t flags;
+    uint8_t reserved[7];
+    uint8_t memory[CHIP8_MEMORY_SIZE];
+};
+
+#define CHIP8_STATE_VBLANK 1
+
+void chip8_save_state(const struct chip8_vm* vm, struct chip8_savestate* state);
+bool chip8_restore_state(struct chip8_vm* vm, const struct chip8_savestate* state);
+bool chip8_write_state(const struct chip8_savestate* state, const char* filepath);
+bool chip8_read_state(struct chip8_savestate* state, const char* filepath);
+
+#endif